@@ -0,0 +1,339 @@
+/******************************************************
+ Talamasca
+ by Jeroen Massar <jeroen@unfix.org>
+ (C) Copyright Jeroen Massar 2004 All Rights Reserved
+ http://unfix.org/projects/talamasca/
+*******************************************************
+ $Author: $
+ $Id: $
+ $Date: $
+*******************************************************
+ Benchmark of the newline scan of sock_getline()
+
+ Compares the per line memchr() of sock_getline()
+ against a plain byte loop and an SSE2 scan that finds
+ all newlines of a chunk in one pass into a table, as
+ was tried for sock_getline(). The SSE2 scan only
+ replaces memchr() when it wins on real traffic. The traffic is cut into BUFFERSIZE chunks, the way
+ recv() fills a struct linebuf, partial lines are
+ carried over into the next chunk.
+
+ Usage: bench_linescan [<capture> [<megabytes>]]
+
+ <capture> is raw traffic as a server sends it, eg
+ recorded with 'socat -r <capture> ...' between
+ talamasca and an IRC server. Without one a burst
+ like stream of typical server lines is generated.
+ The traffic is scanned repeatedly till <megabytes>
+ (default 256) have been scanned by each method.
+******************************************************/
+
+#include "talamasca.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Newlines remembered per pass of the SSE2 scan */
+#define SCAN_MAXLINES 64
+
+/* Result of a method, the sum of the newline offsets is compared */
+struct benchres
+{
+	uint64_t	lines;
+	uint64_t	sum;
+};
+
+/* Finds the newlines in buf[from..to), adds them to res, returns the offset after the last one or 0 */
+typedef unsigned int (*scanfunc)(const char *buf, unsigned int from, unsigned int to, struct benchres *res);
+
+/* What sock_getline() does: a memchr() for every line */
+static unsigned int scan_memchr(const char *buf, unsigned int from, unsigned int to, struct benchres *res)
+{
+	const char	*nl;
+	unsigned int	last = 0;
+
+	while (from < to && (nl = memchr(&buf[from], '\n', to - from)) != NULL)
+	{
+		res->lines++;
+		res->sum += nl - buf;
+		from = last = nl - buf + 1;
+	}
+	return last;
+}
+
+/* Looking at every byte */
+static unsigned int scan_bytes(const char *buf, unsigned int from, unsigned int to, struct benchres *res)
+{
+	unsigned int i, last = 0;
+
+	for (i = from; i < to; i++)
+	{
+		if (buf[i] != '\n') continue;
+		res->lines++;
+		res->sum += i;
+		last = i + 1;
+	}
+	return last;
+}
+
+/*
+ * Find the newlines in buf[from..to), their offsets are stored in ends.
+ * Stops early when ends is full, *scanned is where the search stopped.
+ * Returns the number of newlines found.
+ */
+static unsigned int line_scan(const char *buf, unsigned int from, unsigned int to, unsigned int *ends, unsigned int maxends, unsigned int *scanned)
+{
+	unsigned int	n = 0, i = from;
+	const char	*nl;
+#ifdef __SSE2__
+	const __m128i	lf = _mm_set1_epi8('\n');
+	unsigned int	mask, bit;
+
+	/* 16 bytes at a time, the mask has a bit set for every newline */
+	for (; i + 16 <= to; i += 16)
+	{
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&buf[i]), lf));
+		while (mask)
+		{
+			bit = __builtin_ctz(mask);
+			mask &= mask - 1;
+			ends[n++] = i + bit;
+			if (n == maxends)
+			{
+				*scanned = i + bit + 1;
+				return n;
+			}
+		}
+	}
+#endif
+
+	/* The rest, or everything when there is no SSE2 */
+	while (i < to && (nl = memchr(&buf[i], '\n', to - i)) != NULL)
+	{
+		i = nl - buf;
+		ends[n++] = i++;
+		if (n == maxends) break;
+	}
+
+	*scanned = n == maxends ? i : to;
+	return n;
+}
+
+/* The SSE2 scan, handing out the lines from its table */
+static unsigned int scan_sse2(const char *buf, unsigned int from, unsigned int to, struct benchres *res)
+{
+	unsigned int ends[SCAN_MAXLINES], n, i, last = 0;
+
+	while (from < to)
+	{
+		n = line_scan(buf, from, to, ends, SCAN_MAXLINES, &from);
+		for (i = 0; i < n; i++)
+		{
+			res->lines++;
+			res->sum += ends[i];
+		}
+		if (n > 0) last = ends[n-1] + 1;
+	}
+	return last;
+}
+
+/* Generate <len> bytes of lines like those of a server burst and the chatter after it */
+static char *bench_generate(unsigned int len)
+{
+	char		*data, line[IRC_MAXLINE];
+	unsigned int	fill = 0, i = 0, l;
+
+	data = malloc(len);
+	if (!data)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(-1);
+	}
+
+	while (fill < len)
+	{
+		switch (i % 8)
+		{
+		case 0:
+			snprintf(line, sizeof(line), ":irc.example.org 352 talamasca #chan%u user%u host%u.example.net irc.example.org Nick%u H :2 Some Real Name\r\n", i % 97, i, i % 1013, i);
+			break;
+		case 1:
+			snprintf(line, sizeof(line), ":Nick%u!user%u@host%u.example.net JOIN :#chan%u\r\n", i, i, i % 1013, i % 97);
+			break;
+		case 2:
+			snprintf(line, sizeof(line), ":Nick%u!user%u@host%u.example.net PRIVMSG #chan%u :hi\r\n", i, i, i % 1013, i % 97);
+			break;
+		case 3:
+			snprintf(line, sizeof(line), "PING :irc.example.org\r\n");
+			break;
+		case 4:
+			snprintf(line, sizeof(line), ":Nick%u!user%u@host%u.example.net PRIVMSG #chan%u :%.*s\r\n", i, i, i % 1013, i % 97, 20 + (i * 37) % 380,
+				"Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua. "
+				"Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat. "
+				"Duis aute irure dolor in reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla pariatur. "
+				"Excepteur sint occaecat cupidatat non proident, sunt in culpa qui officia deserunt mollit anim id est laborum.");
+			break;
+		case 5:
+			snprintf(line, sizeof(line), ":Nick%u!user%u@host%u.example.net NICK :Nick%u_\r\n", i, i, i % 1013, i);
+			break;
+		case 6:
+			snprintf(line, sizeof(line), ":Nick%u!user%u@host%u.example.net MODE #chan%u +o Nick%u\r\n", i, i, i % 1013, i % 97, i + 1);
+			break;
+		default:
+			snprintf(line, sizeof(line), ":Nick%u!user%u@host%u.example.net QUIT :Ping timeout: 240 seconds\r\n", i, i, i % 1013);
+			break;
+		}
+		l = strlen(line);
+		if (l > len - fill) l = len - fill;
+		memcpy(&data[fill], line, l);
+		fill += l;
+		i++;
+	}
+
+	return data;
+}
+
+/* Read the capture in <file> */
+static char *bench_load(const char *file, unsigned int *len)
+{
+	FILE		*f;
+	char		*data;
+	long		size;
+
+	f = fopen(file, "r");
+	if (!f)
+	{
+		fprintf(stderr, "Couldn't open %s: %s\n", file, strerror(errno));
+		exit(-1);
+	}
+
+	if (	fseek(f, 0, SEEK_END) != 0 ||
+		(size = ftell(f)) <= 0 ||
+		fseek(f, 0, SEEK_SET) != 0)
+	{
+		fprintf(stderr, "Couldn't determine the size of %s\n", file);
+		exit(-1);
+	}
+
+	data = malloc(size);
+	if (!data)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(-1);
+	}
+
+	if (fread(data, 1, size, f) != (size_t)size)
+	{
+		fprintf(stderr, "Couldn't read %s\n", file);
+		exit(-1);
+	}
+	fclose(f);
+
+	*len = size;
+	return data;
+}
+
+/*
+ * Run <scan> over the traffic till <total> bytes have been scanned.
+ * Every chunk goes into a BUFFERSIZE buffer like a recv() into a
+ * struct linebuf would, the partial line at its end is moved to the
+ * front as sock_getline() does.
+ */
+static double bench_run(scanfunc scan, const char *data, unsigned int len, uint64_t total, struct benchres *res)
+{
+	char		buf[BUFFERSIZE];
+	unsigned int	off = 0, filled = 0, start, chunk;
+	uint64_t	done = 0;
+	struct timespec	t1, t2;
+
+	memset(res, 0, sizeof(*res));
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	while (done < total)
+	{
+		/* Fill the rest of the buffer, wrapping around the traffic */
+		chunk = sizeof(buf) - filled;
+		if (chunk > len - off) chunk = len - off;
+		memcpy(&buf[filled], &data[off], chunk);
+		off += chunk;
+		if (off == len) off = 0;
+
+		/* Only the new data is looked at, the carried part had no newline */
+		start = scan(buf, filled, filled + chunk, res);
+		filled += chunk;
+		done += chunk;
+
+		/* Carry the partial line, a full buffer without a newline is dropped */
+		if (start == 0 && filled == sizeof(buf)) start = filled;
+		filled -= start;
+		memmove(buf, &buf[start], filled);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	return (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	struct
+	{
+		const char	*name;
+		scanfunc	scan;
+	}		methods[] =
+	{
+		{ "memchr per line",	scan_memchr },
+		{ "byte loop",		scan_bytes },
+		{ "sse2 scan",		scan_sse2 },
+	};
+	struct benchres	res, ref;
+	char		*data;
+	unsigned int	len, i;
+	uint64_t	total = 256;
+	double		secs;
+
+	if (argc > 3)
+	{
+		fprintf(stderr, "Usage: %s [<capture> [<megabytes>]]\n", argv[0]);
+		return -1;
+	}
+
+	if (argc > 2) total = strtoul(argv[2], NULL, 10);
+	if (total == 0) total = 1;
+	total *= 1024 * 1024;
+
+	if (argc > 1) data = bench_load(argv[1], &len);
+	else
+	{
+		len = 4 * 1024 * 1024;
+		data = bench_generate(len);
+	}
+
+	printf("Scanning %" PRIu64 " MB of %s (%u bytes) in chunks of %u bytes, %s\n",
+		total / (1024 * 1024), argc > 1 ? argv[1] : "generated traffic", len, BUFFERSIZE,
+#ifdef __SSE2__
+		"with SSE2"
+#else
+		"without SSE2"
+#endif
+		);
+
+	/* Once untimed to warm up the caches and to get the reference result */
+	bench_run(scan_memchr, data, len, total, &ref);
+
+	for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
+	{
+		secs = bench_run(methods[i].scan, data, len, total, &res);
+
+		printf("%-16s %9.1f MB/s %7.2f ns/line %" PRIu64 " lines%s\n",
+			methods[i].name,
+			total / (1024.0 * 1024.0) / secs,
+			res.lines ? secs * 1e9 / res.lines : 0.0,
+			res.lines,
+			res.lines == ref.lines && res.sum == ref.sum ? "" : " MISMATCH");
+
+		if (res.lines != ref.lines || res.sum != ref.sum) return -1;
+	}
+
+	free(data);
+	return 0;
+}
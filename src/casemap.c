@@ -0,0 +1,99 @@
+/******************************************************
+ Talamasca
+ by Jeroen Massar <jeroen@unfix.org>
+ (C) Copyright Jeroen Massar 2004 All Rights Reserved
+ http://unfix.org/projects/talamasca/
+*******************************************************
+ $Author: $
+ $Id: $
+ $Date: $
+*******************************************************
+ Casemapping of nicknames and channelnames
+
+ Which characters are each other's upper and lower case
+ depends on the network, which tells us using the
+ CASEMAPPING token in ISUPPORT (005). Nicks and channels
+ store the folded version of their name as a key, which
+ is what gets hashed and compared.
+******************************************************/
+
+#include "talamasca.h"
+
+/* Names as used in the CASEMAPPING token */
+static const char *casemap_names[CASEMAP_MAX] =
+{
+	[CASEMAP_ASCII]			= "ascii",
+	[CASEMAP_RFC1459]		= "rfc1459",
+	[CASEMAP_STRICT_RFC1459]	= "strict-rfc1459",
+};
+
+/*
+ * Lowercase table per casemapping
+ * ascii folds A-Z, rfc1459 also folds []\^ onto {}|~
+ * and strict-rfc1459 does the same except for ^
+ */
+static unsigned char casemap_tables[CASEMAP_MAX][256];
+
+void casemap_init()
+{
+	unsigned int c;
+
+	for (c = 0; c < 256; c++)
+	{
+		casemap_tables[CASEMAP_ASCII][c]		= (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+		casemap_tables[CASEMAP_RFC1459][c]		= (c >= 'A' && c <= '^') ? c + ('a' - 'A') : c;
+		casemap_tables[CASEMAP_STRICT_RFC1459][c]	= (c >= 'A' && c <= ']') ? c + ('a' - 'A') : c;
+	}
+}
+
+/* The casemapping called <name>, CASEMAP_MAX when unknown */
+enum casemapping casemap_find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < CASEMAP_MAX; i++)
+	{
+		if (strcasecmp(casemap_names[i], name) == 0) return i;
+	}
+	return CASEMAP_MAX;
+}
+
+const char *casemap_name(enum casemapping cm)
+{
+	return cm < CASEMAP_MAX ? casemap_names[cm] : "unknown";
+}
+
+/* Fold <s> into <buf>, truncating it when it doesn't fit, returns the length */
+unsigned int casemap_fold(enum casemapping cm, const char *s, char *buf, unsigned int buflen)
+{
+	const unsigned char	*map = casemap_tables[cm],
+				*p = (const unsigned char *)s;
+	unsigned int		i;
+
+	for (i = 0; p[i] && i < buflen - 1; i++) buf[i] = map[p[i]];
+	buf[i] = '\0';
+	return i;
+}
+
+/* The interned folded version of <s>, release with str_release() */
+char *casemap_key(enum casemapping cm, const char *s)
+{
+	char buf[1024];
+
+	casemap_fold(cm, s, buf, sizeof(buf));
+	return str_intern(buf);
+}
+
+/* FNV-1a hash of an already folded key */
+unsigned int casemap_hash(const char *key)
+{
+	const unsigned char	*p = (const unsigned char *)key;
+	unsigned int		h = 2166136261U;
+
+	for (; *p; p++)
+	{
+		h ^= *p;
+		h *= 16777619U;
+	}
+	return h;
+}
@@ -13,6 +13,16 @@
 
 #include "talamasca.h"
 
+/* Where the channels and their members come from */
+static struct pool channel_pool		= POOL_INIT("channel", struct channel);
+static struct pool channeluser_pool	= POOL_INIT("channeluser", struct channeluser);
+
+/* Match function for the per server channel index, matches on the casemapped name */
+int channel_cmp_name(const void *data, const void *foldname)
+{
+	return strcmp(((const struct channel *)data)->foldname, (const char *)foldname);
+}
+
 struct channel *channel_find_tag(char *tag)
 {
 	struct server	*srv;
@@ -29,79 +39,74 @@ struct channel *channel_find_tag(char *tag)
 	return NULL;
 }
 
+/* Take the membership off both the channel and the user and free it */
 void channeluser_destroy(struct channeluser *cu)
 {
 	if (!cu) return;
-	if (cu->user) listnode_delete(cu->user->channels, cu->channel);
-	free(cu);
+	ptrhash_delete(&cu->channel->members, cu->user);
+	dlist_unlink(&cu->channel->users, &cu->channelnode);
+	dlist_unlink(&cu->user->channels, &cu->usernode);
+	pool_free(&channeluser_pool, cu);
 }
 
 struct channel *channel_add(struct server *server, char *name, char *tag)
 {
-	struct channel *channel = malloc(sizeof(*channel));
+	struct channel *channel = pool_alloc(&channel_pool);
 
 	if (!channel)
 	{
-		dolog(LOG_ERR, "channel", "Not enough memory left to create a new channel!?\n");
+		log_err(channel, "Not enough memory left to create a new channel!?\n");
 		exit(-1);
 	}
 
-	/* Initialize */
-	memset(channel, 0, sizeof(*channel));
-
 	if (tag) channel->tag	= strdup(tag);
 	channel->name		= strdup(name);
+	channel->foldname	= casemap_key(server->casemapping, name);
 	channel->server		= server;
 
-	channel->users		= list_new();
-	channel->users->del 	= (void(*)(void *))channeluser_destroy;
+	dlist_init(&channel->users);
+	ptrhash_init(&channel->members);
 
 	/* Add it to the list */
 	listnode_add(server->channels, channel);
+	hash_add(server->channelnames, casemap_hash(channel->foldname), channel);
 	
-	dolog(LOG_DEBUG, "channel", "channel_add(%s on %s:%s)\n", name, server->hostname, server->port);
+	log_debug(channel, "channel_add(%s on %s:%s)\n", name, server->hostname, server->port);
 
 	return channel;
 }
 
 struct channeluser *channel_find_user(struct channel *channel, struct user *user)
 {
-	struct channeluser	*cu;
-	struct listnode		*ln;
-	
 	if (!channel)
 	{
-		dolog(LOG_ERR, "channel", "channel_find_user() - Something passed me a NULL channel!\n");
+		log_err(channel, "channel_find_user() - Something passed me a NULL channel!\n");
 		return NULL;
 	}
 	if (!user)
 	{
-		dolog(LOG_ERR, "channel", "channel_find_user() - Something passed me a NULL user!\n");
+		log_err(channel, "channel_find_user() - Something passed me a NULL user!\n");
 		return NULL;
 	}
 
-	LIST_LOOP(channel->users, cu, ln)
-	{
-		if (cu->user == user) return cu;
-	}
-
-	return NULL;
+	return ptrhash_find(&channel->members, user);
 }
 
-/* Send a message to a channel */
-void channel_message(struct channel *channel, struct user *user, char *message, ...)
+/*
+ * Relay <body> (a line ending in \n) from <user> to a channel
+ * The body is shared by all the links and recipients, only
+ * the part in front of it is written per recipient
+ */
+void channel_relay(struct channel *channel, struct user *user, struct msgbuf *body)
 {
-	char			buf[2048];
+	char			head[BUFFERSIZE], from[BUFFERSIZE], targets[BUFFERSIZE];
 	struct channeluser	*cu;
-	struct listnode		*ln;
-	va_list ap;
+	struct dlistnode	*ln;
+	struct iovec		iov[4];
+	unsigned int		max, num = 0, tlen = 0, nlen;
+	int			len, room;
 	
-	if (!channel || !user || !message) return;
-
-	va_start(ap, message);
-	/* Format the string */
-	vsnprintf(buf, sizeof(buf), message, ap);
-	va_end(ap);
+	if (!channel || !user || !body) return;
 
 	if (	channel->server->type == SRV_RFC1459 ||
 		channel->server->type == SRV_TS)
@@ -109,9 +114,16 @@ void channel_message(struct channel *channel, struct user *user, char *message,
 		/* Ignore it when there is no source user */
 		if (!user) return;
 
+		/* Speaking before the burst came by? -> introduce first */
+		cu = channel_find_user(channel, user);
+		if (cu && !cu->introduced) channel_introduce(channel, user);
+
 		/* Show it using a privmsg */
-		server_printf(channel->server, ":%s PRIVMSG %s :%s\n",
-			user->nick, channel->name, buf);
+		len = snprintf(head, sizeof(head), ":%s PRIVMSG %s :", user->nick, channel->name);
+		if (len >= (int)sizeof(head)) len = sizeof(head)-1;
+		iov[0].iov_base = head;
+		iov[0].iov_len = len;
+		server_sendv(channel->server, iov, 1, body);
 		return;
 	}
 	
@@ -120,17 +132,34 @@ void channel_message(struct channel *channel, struct user *user, char *message,
 		/* Ignore it when there is no source user */
 		if (!user) return;
 
-		dolog(LOG_ERR, "channel", "channel_message() - P10 not supported -> exit\n");
+		log_err(channel, "channel_message() - P10 not supported -> exit\n");
 		exit(-42);
 	}
 
+	/* Who said it, in front of the body */
+	if (strncmp(body->data, "### ", 4) == 0 && channel->server->type == SRV_BITLBEE) len = 0;
+	else len = snprintf(from, sizeof(from), "%s: ", user->nick);
+	if (len >= (int)sizeof(from)) len = sizeof(from)-1;
+	iov[3].iov_base = from;
+	iov[3].iov_len = len;
+
 	/* Bitlbee */
 	if (channel->server->type == SRV_BITLBEE)
 	{
-		bool prefix = strncmp(buf, "### ", 4) == 0 || !user ? false : true;
-
-		/* Notify all the bitlbee users on the channel */
-		LIST_LOOP(channel->users, cu, ln)
+		/* Only the targets differ per line */
+		iov[0].iov_base = "PRIVMSG ";
+		iov[0].iov_len = 8;
+		iov[1].iov_base = targets;
+		iov[2].iov_base = " :";
+		iov[2].iov_len = 2;
+
+		/* Room left for the targets in one line (the \n becomes \r\n) */
+		room = IRC_MAXLINE - 1 - 8 - 2 - (int)iov[3].iov_len - (int)body->len;
+		if (room < 0) room = 0;
+		max = server_maxtargets(channel->server);
+
+		/* Notify all the bitlbee users on the channel in join order, as many per line as allowed */
+		DLIST_LOOP(&channel->users, cu, ln)
 		{
 			/*
 			 * - Don't send it to itself
@@ -141,33 +170,135 @@ void channel_message(struct channel *channel, struct user *user, char *message,
 				channel->server != cu->user->server ||
 				cu->user == channel->server->user) continue;
 
-			/* Show it using a privmsg */
-			server_printf(channel->server,
-				"PRIVMSG %s :%s%s%s\n",
-				cu->user->nick,
-				prefix ? user->nick : "", prefix ? ": " : "",
-				buf);
+			/* This one doesn't fit anymore? -> send the ones we have and start a new line */
+			nlen = strlen(cu->user->nick);
+			if (	num > 0 &&
+				(num == max ||
+				 tlen + 1 + nlen > (unsigned int)room ||
+				 tlen + 1 + nlen > sizeof(targets)))
+			{
+				iov[1].iov_len = tlen;
+				server_sendv(channel->server, iov, 4, body);
+				num = tlen = 0;
+			}
+
+			/* A nick that doesn't even fit on its own, the link can't have it */
+			if (nlen > sizeof(targets))
+			{
+				log_warn(channel, "Not relaying to overly long nick on %s:%s\n",
+					channel->server->hostname, channel->server->port);
+				continue;
+			}
+
+			if (num > 0) targets[tlen++] = ',';
+			memcpy(&targets[tlen], cu->user->nick, nlen);
+			tlen += nlen;
+			num++;
+		}
+
+		/* Show it using a privmsg */
+		if (num > 0)
+		{
+			iov[1].iov_len = tlen;
+			server_sendv(channel->server, iov, 4, body);
 		}
 		return;
 	}
 
 	/* Normal user connection */
-	server_printf(channel->server,
-		"PRIVMSG %s :%s%s%s\n",
-		channel->name,
-		user ? user->nick : "",
-		user ? ": " : "",
-		buf);
-	return;
+	len = snprintf(head, sizeof(head), "PRIVMSG %s :", channel->name);
+	if (len >= (int)sizeof(head)) len = sizeof(head)-1;
+	iov[2].iov_base = head;
+	iov[2].iov_len = len;
+	server_sendv(channel->server, &iov[2], 2, body);
+}
+
+/* Send a message to a channel */
+void channel_message(struct channel *channel, struct user *user, char *message, ...)
+{
+	struct msgbuf	*body;
+	va_list		ap;
+
+	if (!channel || !user || !message) return;
+
+	va_start(ap, message);
+	body = msgbuf_lineA(message, ap);
+	va_end(ap);
+
+	channel_relay(channel, user, body);
+	msgbuf_release(body);
+}
+
+/* Send the SJOIN that is being packed for <server>, if there is one */
+void channel_sjoin_flush(struct server *server)
+{
+	struct sjoin	*sj = &server->sjoin;
+	struct iovec	iov;
+
+	if (!sj->channel) return;
+
+	/* Take it off first, sending it would end up here again */
+	sj->channel = NULL;
+	sj->line[sj->len++] = '\n';
+
+	iov.iov_base = sj->line;
+	iov.iov_len = sj->len;
+	server_sendv(server, &iov, 1, NULL);
+}
+
+/*
+ * Join <nick> to <channel> on a server link. Consecutive joins to the
+ * same channel are packed into one SJOIN line, which is sent when it is
+ * full, when another channel comes along, before anything else is sent
+ * to the link, or at the latest when the event loop flushes the link.
+ */
+static void channel_sjoin(struct channel *channel, const char *prefix, const char *nick)
+{
+	struct server	*server = channel->server;
+	struct sjoin	*sj = &server->sjoin;
+	unsigned int	n = strlen(prefix) + strlen(nick);
+
+	/* Room for " nick" and the \r\n the other side counts? */
+	if (sj->channel && (sj->channel != channel || sj->len + 1 + n > IRC_MAXLINE - 2))
+	{
+		channel_sjoin_flush(server);
+	}
+
+	if (!sj->channel)
+	{
+		sj->len = snprintf(sj->line, sizeof(sj->line), ":%s SJOIN %u %u %s + :",
+			server->name, (unsigned int)time(NULL), (unsigned int)time(NULL), channel->name);
+		if (sj->len + n > IRC_MAXLINE - 2)
+		{
+			log_err(channel, "SJOIN of %s to %s on %s:%s doesn't fit in a line\n",
+				nick, channel->name, server->hostname, server->port);
+			return;
+		}
+		sj->channel = channel;
+		sj->nicks = 0;
+
+		/* Make sure it goes out before the event loop sleeps */
+		event_defer(server->socket);
+	}
+
+	if (sj->nicks++ > 0) sj->line[sj->len++] = ' ';
+	n = strlen(prefix);
+	memcpy(&sj->line[sj->len], prefix, n);
+	sj->len += n;
+	n = strlen(nick);
+	memcpy(&sj->line[sj->len], nick, n);
+	sj->len += n;
 }
 
 void channel_introduce(struct channel *channel, struct user *user)
 {
-	struct channeluser *cu;
+	struct channeluser	*cu, *lcu;
+	char			prefix[3];
+	unsigned int		n;
 
 	if (!channel || !user) return;
 
-	dolog(LOG_DEBUG, "channel", "channel_introduce %s!%s@%s to %s on %s:%s\n",
+	log_debug(channel, "channel_introduce %s!%s@%s to %s on %s:%s\n",
 		user->nick, user->ident, user->host,
 		channel->name,
 		channel->server->hostname, channel->server->port);
@@ -175,7 +306,7 @@ void channel_introduce(struct channel *channel, struct user *user)
 	/* Don't introduce server users */	
 	if (user == user->server->user)
 	{
-		dolog(LOG_DEBUG, "channel", "Ignoring introduction of server user %s\n", user->nick);
+		log_debug(channel, "Ignoring introduction of server user %s\n", user->nick);
 		return;
 	}
 
@@ -184,7 +315,7 @@ void channel_introduce(struct channel *channel, struct user *user)
 	
 	if (cu && cu->introduced)
 	{
-		dolog(LOG_DEBUG, "channel", "User %s!%s@%s already introduced to channel %s on %s:%s\n",
+		log_debug(channel, "User %s!%s@%s already introduced to channel %s on %s:%s\n",
 			user->nick, user->ident, user->host,
 			channel->name, channel->server->hostname, channel->server->port);
 		return;
@@ -193,27 +324,27 @@ void channel_introduce(struct channel *channel, struct user *user)
 	/* Not added yet? */
 	if (!cu)
 	{
-		cu = malloc(sizeof(*cu));
+		cu = pool_alloc(&channeluser_pool);
 		if (!cu)
 		{
-			dolog(LOG_ERR, "channel", "channel_introduce() Couldn't allocate memory for serveruser\n");
+			log_err(channel, "channel_introduce() Couldn't allocate memory for channeluser\n");
 			exit(-42);
 		}
-		memset(cu, 0, sizeof(*cu));
 		
 		cu->channel = channel;
 		cu->user = user;
 
 		/* Add the user to the channel member list */
-		listnode_add(channel->users, cu);
+		dlist_add(&channel->users, &cu->channelnode, cu);
+		ptrhash_add(&channel->members, user, cu);
 		
 		/* Also add a backreference */
-		listnode_add(user->channels, channel);
+		dlist_add(&user->channels, &cu->usernode, cu);
 	}
 
 	if (channel->server->state != SS_CONNECTED)
 	{
-		dolog(LOG_DEBUG, "channel", "Server %s:%s is not connected, thus cannot introduce user %s to channel %s\n",
+		log_debug(channel, "Server %s:%s is not connected, thus cannot introduce user %s to channel %s\n",
 			channel->server->hostname, channel->server->port, user->nick, channel->name);
 		return;
 	}
@@ -229,7 +360,7 @@ void channel_introduce(struct channel *channel, struct user *user)
 		channel->server->type != SRV_USER &&
 		channel->server->type != SRV_BITLBEE)
 	{
-		dolog(LOG_DEBUG, "channel", "Not introducing user onto own server\n");
+		log_debug(channel, "Not introducing user onto own server\n");
 		return;
 	}
 
@@ -239,10 +370,18 @@ void channel_introduce(struct channel *channel, struct user *user)
 	if (	channel->server->type == SRV_RFC1459 ||
 		channel->server->type == SRV_TS)
 	{
+		/* The link has to know the user first, the burst might not have come by yet */
+		server_introduce(channel->server, user);
+
+		/* Carry over the status the user has on the channel this one is linked with */
+		lcu = channel->link ? channel_find_user(channel->link, user) : NULL;
+		n = 0;
+		if (lcu && (lcu->f_creator || lcu->f_operator))	prefix[n++] = '@';
+		if (lcu && lcu->f_voice)			prefix[n++] = '+';
+		prefix[n] = '\0';
+
 		/* Introduce this user to the channel */
-		server_printf(channel->server,
-			":%s SJOIN %u %u %s + :%s\n",
-			channel->server->name, time(NULL), time(NULL), channel->name, user->nick);
+		channel_sjoin(channel, prefix, user->nick);
 	}
 	else if (channel->server->type == SRV_P10)
 	{
@@ -263,14 +402,14 @@ void channel_leave(struct channel *channel, struct user *user, char *reason, boo
 
 	if (!channel || !user) return;
 
-	dolog(LOG_DEBUG, "channel", "channel_leave(%s: %s!%s@%s)\n", channel->name, user->nick, user->ident, user->host);
+	log_debug(channel, "channel_leave(%s: %s!%s@%s)\n", channel->name, user->nick, user->ident, user->host);
 
 	/* Try to find the user on the channel */
 	cu = channel_find_user(channel, user);
 	
 	if (!cu)
 	{
-		dolog(LOG_DEBUG, "channel", "User %s!%s@%s was not on channel %s on %s:%s\n",
+		log_debug(channel, "User %s!%s@%s was not on channel %s on %s:%s\n",
 			user->nick, user->ident, user->host,
 			channel->name, channel->server->hostname, channel->server->port);
 		return;
@@ -299,30 +438,27 @@ void channel_leave(struct channel *channel, struct user *user, char *reason, boo
 		}
 	}
 
-	/* Remove the user from the user list */
-	listnode_delete(channel->users, cu);
-
-	/* Remove the channel from the user's list */
-	listnode_delete(user->channels, channel);
+	/* Remove the user from the channel and the channel from the user */
+	channeluser_destroy(cu);
 
-	dolog(LOG_DEBUG, "channel", "channel_leave(%s: %s!%s@%s) - LEFT\n", channel->name, user->nick, user->ident, user->host);
+	log_debug(channel, "channel_leave(%s: %s!%s@%s) - LEFT\n", channel->name, user->nick, user->ident, user->host);
 }
 
 void channel_link(struct channel *channel, struct channel *link)
 {
 	struct channeluser	*cu;
-	struct listnode		*ln;
+	struct dlistnode	*ln;
 
 	/* Cross link the channels */
 	channel->link = link;
 	link->link = channel;
 
 	/* Introduce users to eachother */
-	LIST_LOOP(channel->users, cu, ln)
+	DLIST_LOOP(&channel->users, cu, ln)
 	{
 		channel_introduce(link, cu->user);
 	}
-	LIST_LOOP(link->users, cu, ln)
+	DLIST_LOOP(&link->users, cu, ln)
 	{
 		channel_introduce(channel, cu->user);
 	}
@@ -332,7 +468,7 @@ void channel_adduser(struct channel *channel, struct user *user)
 {
 	if (!channel || !user) return;
 
-	dolog(LOG_DEBUG, "channel", "channel_adduser(%s, %s)\n", channel->name, user->nick);
+	log_debug(channel, "channel_adduser(%s, %s)\n", channel->name, user->nick);
 	/* Introduce the user on the channel */
 	channel_introduce(channel, user);
 	/* And also introduce the user on the linked channel */
@@ -343,22 +479,25 @@ void channel_deluser(struct channel *channel, struct user *user, char *reason, b
 {
 	if (!channel || !user) return;
 
-	dolog(LOG_DEBUG, "channel", "channel_deluser(%s, %s)\n", channel->name, user->nick);
+	log_debug(channel, "channel_deluser(%s, %s)\n", channel->name, user->nick);
 	/* Let the user leave the channel */
 	channel_leave(channel, user, reason, notify);
 	/* And also leave the linked channel */
 	if (channel->link)
 	{
-		dolog(LOG_DEBUG, "channel", "channel_deluser(%s, %s) link of %s\n", channel->link->name, user->nick, channel->name);
+		log_debug(channel, "channel_deluser(%s, %s) link of %s\n", channel->link->name, user->nick, channel->name);
 		channel_leave(channel->link, user, reason, true);
 	}
 }
 
 void channel_destroy(struct channel *channel)
 {
+	struct channeluser	*cu;
+	struct dlistnode	*ln, *ln2;
+
 	if (!channel) return;
 
-	dolog(LOG_DEBUG, "channel", "channel_destroy(%s)\n", channel->name);
+	log_debug(channel, "channel_destroy(%s)\n", channel->name);
 
 	/* Remove the link between the channels */
 	if (channel->link)
@@ -368,47 +507,59 @@ void channel_destroy(struct channel *channel)
 	}
 
 	/* Purge the users from this channel */
-	list_delete(channel->users);
+	DLIST_LOOP2(&channel->users, cu, ln, ln2)
+	{
+		channeluser_destroy(cu);
+	}
+	DLIST_LOOP2_END
+	ptrhash_clear(&channel->members);
 
-	if (channel->server)	listnode_delete(channel->server->channels, channel);
+	if (channel->server)
+	{
+		server_burst_forget_channel(channel);
+		if (channel->server->sjoin.channel == channel) channel_sjoin_flush(channel->server);
+		listnode_delete(channel->server->channels, channel);
+		hash_delete(channel->server->channelnames, casemap_hash(channel->foldname), channel);
+	}
 	if (channel->name)	free(channel->name);
+	str_release(channel->foldname);
 	if (channel->tag)	free(channel->tag);
-	if (channel->topic)	free(channel->topic);
-	if (channel->topic_who)	free(channel->topic_who);
+	str_release(channel->topic);
+	str_release(channel->topic_who);
 	if (channel->key)	free(channel->key);
 
-	free(channel);
+	pool_free(&channel_pool, channel);
 }
 
 void channel_change_topic(struct channel *channel, char *topic)
 {
 	if (!channel)
 	{
-		dolog(LOG_DEBUG, "channel", "channel_change_topic() - Something passed me a NULL channel!\n");
+		log_debug(channel, "channel_change_topic() - Something passed me a NULL channel!\n");
 		return;
 	}
-	if (channel->topic)	free(channel->topic);
-	if (topic)		channel->topic = strdup(topic);
-	else			channel->topic = NULL;
+	topic = str_intern(topic);
+	str_release(channel->topic);
+	channel->topic = topic;
 }
 
 void channel_change_topic_who(struct channel *channel, char *who)
 {
 	if (!channel)
 	{
-		dolog(LOG_DEBUG, "channel", "channel_change_topic_who() - Something passed me a NULL channel!\n");
+		log_debug(channel, "channel_change_topic_who() - Something passed me a NULL channel!\n");
 		return;
 	}
-	if (channel->topic_who)	free(channel->topic_who);
-	if (who)		channel->topic_who = strdup(who);
-	else			channel->topic_who = NULL;
+	who = str_intern(who);
+	str_release(channel->topic_who);
+	channel->topic_who = who;
 }
 
 void channel_change_topic_when(struct channel *channel, time_t when)
 {
 	if (!channel)
 	{
-		dolog(LOG_DEBUG, "channel", "channel_change_topic_who() - Something passed me a NULL channel!\n");
+		log_debug(channel, "channel_change_topic_who() - Something passed me a NULL channel!\n");
 		return;
 	}
 	if (when == 0) when = time(NULL);
@@ -419,7 +570,7 @@ void channel_change_key(struct channel *channel, char *key)
 {
 	if (!channel)
 	{
-		dolog(LOG_DEBUG, "channel", "channel_change_key() - Something passed me a NULL channel!\n");
+		log_debug(channel, "channel_change_key() - Something passed me a NULL channel!\n");
 		return;
 	}
 	if (channel->key)	free(channel->key);
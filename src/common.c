@@ -17,34 +17,6 @@
 /*#define E(x) x*/
 #define E(x) {}
 
-void dologA(int level, char *module, const char *fmt, va_list ap)
-{
-	if (g_conf && !g_conf->verbose && level == LOG_DEBUG) return;
-	if (g_conf && g_conf->daemonize) vsyslog(LOG_LOCAL7|level, fmt, ap);
-	else
-	{
-		if (g_conf && g_conf->verbose)
-		{
-			printf("[%6s : %7s] ",
-				level == LOG_DEBUG ?	"debug" :
-				(level == LOG_ERR ?	"error" :
-				(level == LOG_WARNING ?	"warn" :
-				(level == LOG_INFO ?	"info" : ""))),
-				module);
-		}
-		else if (level == LOG_ERR) printf("Error: ");
-		vprintf(fmt, ap);
-	}
-}
-
-void dolog(int level, char *module, const char *fmt, ...)
-{
-	va_list ap;
-	va_start(ap, fmt);
-	dologA(level, module, fmt, ap);
-	va_end(ap);
-}
-
 int huprunning()
 {
 	int pid;
@@ -64,16 +36,23 @@ void savepid()
 	fprintf(f, "%d", getpid());
 	fclose(f);
 
-	dolog(LOG_INFO, "common", "Running as PID %d\n", getpid());
+	log_info(common, "Running as PID %d\n", getpid());
 }
 
-void cleanpid(int i)
+/*
+ * Handler for SIGTERM/SIGINT, only tells the main loop to stop,
+ * logging from here could deadlock on the lock of the logger
+ */
+void quitsignal(int i)
 {
-	if (g_conf && g_conf->quit == false) dolog(LOG_INFO, "common", "Trying to exit...\n");
-	unlink(PIDFILE);
 	if (g_conf) g_conf->quit = true;
 }
 
+void cleanpid()
+{
+	unlink(PIDFILE);
+}
+
 int sock_printfA(SOCKET sock, const char *fmt, va_list ap)
 {
 	char		buf[2048];
@@ -97,7 +76,7 @@ int sock_printfA(SOCKET sock, const char *fmt, va_list ap)
 			len = (int)strlen(buf);
 			if (len > 0) buf[len-1] = '\0';
 			/* dump the information */
-			dolog(LOG_DEBUG, "common", "sock_printf (%03x) : \"%s\"\n", sock, buf);
+			log_debug(common, "sock_printf (%03x) : \"%s\"\n", sock, buf);
 		}
 	}
 	return sent;
@@ -115,97 +94,323 @@ int sock_printf(SOCKET sock, const char *fmt, ...)
 	return i;
 }
 
-/* Read a line from a socket and store it in ubuf
+/* A new message holding a copy of <data>, the caller holds the first reference */
+struct msgbuf *msgbuf_new(const char *data, unsigned int len)
+{
+	struct msgbuf *m = malloc(sizeof(*m) + len);
+
+	if (!m)
+	{
+		log_err(common, "Not enough memory left for a message!?\n");
+		exit(-1);
+	}
+	m->refs = 1;
+	m->len = len;
+	memcpy(m->data, data, len);
+	m->data[len] = '\0';
+	return m;
+}
+
+/* A new message from a format, always ending in exactly one \n */
+struct msgbuf *msgbuf_lineA(const char *fmt, va_list ap)
+{
+	char		buf[BUFFERSIZE];
+	unsigned int	len;
+
+	len = vsnprintf(buf, sizeof(buf)-1, fmt, ap);
+	if (len >= sizeof(buf)-1) len = sizeof(buf)-2;
+
+	while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == '\r')) len--;
+	buf[len++] = '\n';
+
+	return msgbuf_new(buf, len);
+}
+
+struct msgbuf *msgbuf_line(const char *fmt, ...)
+{
+	struct msgbuf	*m;
+	va_list		ap;
+
+	va_start(ap, fmt);
+	m = msgbuf_lineA(fmt, ap);
+	va_end(ap);
+	return m;
+}
+
+/* Drop a reference, the last one frees the message */
+void msgbuf_release(struct msgbuf *m)
+{
+	if (m && --m->refs == 0) free(m);
+}
+
+/* Append a piece to the queue */
+static bool sendq_addseg(struct sendq *q, struct msgbuf *msg, unsigned int off, unsigned int len)
+{
+	struct sendseg	*segs;
+	unsigned int	size;
+
+	if (q->numsegs == q->sizesegs)
+	{
+		/* Reclaim the pieces already sent */
+		if (q->head > 0)
+		{
+			q->numsegs -= q->head;
+			memmove(q->segs, &q->segs[q->head], q->numsegs * sizeof(*q->segs));
+			q->head = 0;
+		}
+		else
+		{
+			size = q->sizesegs ? q->sizesegs * 2 : 16;
+			segs = realloc(q->segs, size * sizeof(*segs));
+			if (!segs)
+			{
+				log_err(common, "Not enough memory left to grow the sendq!?\n");
+				return false;
+			}
+			q->segs = segs;
+			q->sizesegs = size;
+		}
+	}
+
+	q->segs[q->numsegs].msg = msg;
+	q->segs[q->numsegs].off = off;
+	q->segs[q->numsegs].len = len;
+	q->numsegs++;
+	q->depth += len;
+	return true;
+}
+
+/* Queue <len> bytes of <data>, growing the queue when needed */
+bool sendq_append(struct sendq *q, const char *data, unsigned int len)
+{
+	struct sendseg	*seg;
+	unsigned int	i, size, start;
+	char		*buf;
+
+	if (len == 0) return true;
+
+	/* Doesn't fit at the end? First reclaim the part already sent */
+	if (q->used + len > q->size)
+	{
+		/* The oldest copied data still waiting */
+		start = q->used;
+		for (i = q->head; i < q->numsegs; i++)
+		{
+			if (q->segs[i].msg) continue;
+			start = q->segs[i].off;
+			break;
+		}
+
+		if (start > 0)
+		{
+			q->used -= start;
+			if (q->used > 0) memmove(q->buf, &q->buf[start], q->used);
+			for (; i < q->numsegs; i++)
+			{
+				if (!q->segs[i].msg) q->segs[i].off -= start;
+			}
+		}
+	}
+
+	/* Still doesn't fit? -> grow */
+	if (q->used + len > q->size)
+	{
+		size = q->size ? q->size : BUFFERSIZE;
+		while (size < q->used + len) size *= 2;
+
+		buf = realloc(q->buf, size);
+		if (!buf)
+		{
+			log_err(common, "Not enough memory left to grow the sendq!?\n");
+			return false;
+		}
+		q->buf = buf;
+		q->size = size;
+	}
+
+	memcpy(&q->buf[q->used], data, len);
+
+	/* Directly behind the last piece? -> make that one longer */
+	seg = q->numsegs > q->head ? &q->segs[q->numsegs-1] : NULL;
+	if (seg && !seg->msg && seg->off + seg->len == q->used)
+	{
+		seg->len += len;
+		q->depth += len;
+	}
+	else if (!sendq_addseg(q, NULL, q->used, len)) return false;
+
+	q->used += len;
+	return true;
+}
+
+/* Queue a reference to a shared message, nothing gets copied */
+bool sendq_append_msg(struct sendq *q, struct msgbuf *m)
+{
+	if (m->len == 0) return true;
+	if (!sendq_addseg(q, m, 0, m->len)) return false;
+	msgbuf_ref(m);
+	return true;
+}
+
+/*
+ * Send as much of the queue as the socket accepts
+ * Returns the number of bytes sent or -1 on failure
+ */
+int sendq_flush(SOCKET sock, struct sendq *q)
+{
+	struct iovec	iov[SENDQ_IOV];
+	struct sendseg	*seg;
+	unsigned int	i, n;
+	int		r, sent = 0;
+
+	while (q->depth > 0)
+	{
+		for (n = 0, i = q->head; i < q->numsegs && n < SENDQ_IOV; i++, n++)
+		{
+			seg = &q->segs[i];
+			iov[n].iov_base = seg->msg ? &seg->msg->data[seg->off] : &q->buf[seg->off];
+			iov[n].iov_len = seg->len;
+		}
+
+		r = writev(sock, iov, n);
+		if (r < 0)
+		{
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		sent += r;
+		q->depth -= r;
+
+		/* Take off what went out */
+		while (r > 0)
+		{
+			seg = &q->segs[q->head];
+			if ((unsigned int)r < seg->len)
+			{
+				seg->off += r;
+				seg->len -= r;
+				break;
+			}
+			r -= seg->len;
+			msgbuf_release(seg->msg);
+			q->head++;
+		}
+	}
+
+	/* Empty? -> start at the front again */
+	if (q->depth == 0) q->head = q->numsegs = q->used = 0;
+
+	return sent;
+}
+
+void sendq_free(struct sendq *q)
+{
+	unsigned int i;
+
+	for (i = q->head; i < q->numsegs; i++) msgbuf_release(q->segs[i].msg);
+	if (q->buf) free(q->buf);
+	if (q->segs) free(q->segs);
+	memset(q, 0, sizeof(*q));
+}
+
+/* Forget everything that is in the buffer */
+void linebuf_reset(struct linebuf *lb)
+{
+	lb->start = lb->filled = lb->scanned = 0;
+}
+
+/*
+ * Read a line from a socket, the line is returned in place in lb->buf
  * Note: uses internal caching, this should be the only function
- * used to read from the sock! The internal cache is rbuf.
+ * used to read from the sock! The unprocessed data lives between
+ * lb->start and lb->filled. The search for the next newline resumes
+ * at lb->scanned, thus a partial line is not searched again every
+ * time more of it comes in.
+ *
+ * On success *line points to the '\0' terminated line (without \r\n),
+ * which stays valid till the next call, *linelen is its length and the
+ * number of bytes consumed from the socket is returned.
+ * Returns 0 when no full line is available yet and -1 on errors.
  */
-int sock_getline(SOCKET sock, char *rbuf, unsigned int rbuflen, unsigned int *filled, char *ubuf, unsigned int ubuflen)
+int sock_getline(SOCKET sock, struct linebuf *lb, char **line, unsigned int *linelen)
 {
 	int		i = 0;
-	unsigned int	j = 0;
+	unsigned int	j = 0, nl;
+	char		*p;
 	
 	/* A closed socket? -> clear the buffer */
 	if (sock == -1)
 	{
-		memset(rbuf, 0, rbuflen);
-		*filled = 0;
+		linebuf_reset(lb);
 		return -1;
 	}
 
-	/* Clear the caller supplied buffer, just in case */
-	memset(ubuf, 0, ubuflen);
-
 	for (;;)
 	{
-		E(dolog(LOG_DEBUG, "common", "gl() - Filled %u\n", *filled);)
+		E(log_debug(common, "gl() - Start %u, Filled %u, Scanned %u\n", lb->start, lb->filled, lb->scanned);)
 
-		/* Did we still have something in the buffer? */
-		if (*filled > 0)
+		/* Did we find a newline? */
+		if (lb->scanned < lb->filled && (p = memchr(&lb->buf[lb->scanned], '\n', lb->filled - lb->scanned)) != NULL)
 		{
-			E(dolog(LOG_DEBUG, "common", "gl() - Seeking newline\n");)
+			nl = p - lb->buf;
+			*line = &lb->buf[lb->start];
+			j = nl - lb->start;
 
-			/* Walk to the end or until we reach a \n */
-			for (j=0; (j < (*filled-1)) && (rbuf[j] != '\n'); j++);
+			E(log_debug(common, "gl() - Found newline at %u\n", nl);)
 
-			E(dolog(LOG_DEBUG, "common", "gl() - Seeking newline - end\n");)
+			/* Newline with a Linefeed in front of it ? -> remove it */
+			if (j > 0 && (*line)[j-1] == '\r') j--;
 
-			/* Did we find a newline? */
-			if (rbuf[j] == '\n')
-			{
-				E(dolog(LOG_DEBUG, "common", "gl() - Found newline at %u\n", j+1);)
-
-				/* Newline with a Linefeed in front of it ? -> remove it */
-				if (rbuf[j] == '\n' && rbuf[j-1] == '\r')
-				{
-					E(dolog(LOG_DEBUG, "common", "gl() - Removing LF\n");)
-					j--;
-				}
-				E(else dolog(LOG_DEBUG, "common", "gl() - No LF\n");)
-
-				if (j >= ubuflen)
-				{
-					dolog(LOG_ERR, "common", "UBuffer almost flowed over without receiving a newline (%u > %u)\n", j, ubuflen);
-					return -1;
-				}
-
-				/* Copy this over to the caller */
-				memcpy(ubuf, rbuf, j);
-
-				E(dolog(LOG_DEBUG, "common", "gl() - Copied %u bytes from %x to %x\n", j, rbuf, ubuf);)
-
-				/* Count the \r if it is there */
-				if (rbuf[j] == '\r') j++;
-				/* Count the \n */
-				j++;
-
-				/* filled = what is left in the buffer */
-				*filled -= j;
-				
-				E(dolog(LOG_DEBUG, "common", "gl() - %u bytes left in the buffer\n", *filled);)
-
-				/* Now move the rest of the buffer to the front */
-				if (*filled > 0) memmove(rbuf, &rbuf[j], *filled);
-				else *filled = 0;
-
-				/* Show this as debug output */
-				if (g_conf->verbose) dolog(LOG_DEBUG, "common", "sock_getline(%03x) : \"%s\"\n", sock, ubuf);
-
-				/* We got ourselves a line in 'buf' thus return to the caller */
-				return j;
-			}
+			/* Terminate the line in place */
+			(*line)[j] = '\0';
+			*linelen = j;
+
+			/* Consumed: the line, the \r if it is there and the \n */
+			j = nl + 1 - lb->start;
+			lb->start = lb->scanned = nl + 1;
+
+			/* Everything consumed? -> start at the front again */
+			if (lb->start >= lb->filled) linebuf_reset(lb);
+
+			/* Show this as debug output */
+			if (g_conf->verbose) log_debug(common, "sock_getline(%03x) : \"%s\"\n", sock, *line);
+
+			/* We got ourselves a line thus return to the caller */
+			return j;
+		}
+
+		/* No newline in there, don't search that part again */
+		lb->scanned = lb->filled;
+
+		/* No room left at the end? Move the partial line to the front, only now */
+		if (lb->filled >= sizeof(lb->buf) && lb->start > 0)
+		{
+			E(log_debug(common, "gl() - Compacting %u bytes\n", lb->filled - lb->start);)
+			lb->filled -= lb->start;
+			lb->scanned -= lb->start;
+			memmove(lb->buf, &lb->buf[lb->start], lb->filled);
+			lb->start = 0;
 		}
 
-		E(dolog(LOG_DEBUG, "common", "gl() - Trying to receive (max=%u)...\n", rbuflen-*filled-10);)
+		/* Buffer overflow? */
+		if (lb->filled >= sizeof(lb->buf))
+		{
+			log_err(common, "RBuffer almost flowed over without receiving a newline\n");
+			return -1;
+		}
+
+		E(log_debug(common, "gl() - Trying to receive (max=%u)...\n", sizeof(lb->buf)-lb->filled);)
 
 		/* Fill the rest of the buffer */
-		i = recv(sock, &rbuf[*filled], rbuflen-*filled-10, 0);
+		i = recv(sock, &lb->buf[lb->filled], sizeof(lb->buf)-lb->filled, 0);
 
-		E(dolog(LOG_DEBUG, "common", "gl() - Received %d\n", i);)
+		E(log_debug(common, "gl() - Received %d\n", i);)
 
 		/* Fail on errors */
 		if (i <= 0)
 		{
-			if (errno == EAGAIN)
+			if (i < 0 && errno == EAGAIN)
 			{
 				/* printf("[strace] returning 0 (%d)\n", errno); */
 				return 0;
@@ -215,14 +420,7 @@ int sock_getline(SOCKET sock, char *rbuf, unsigned int rbuflen, unsigned int *fi
 		}
 
 		/* We got more filled space! */
-		*filled+=i;
-
-		/* Buffer overflow? */
-		if (*filled >= (rbuflen-8))
-		{
-			dolog(LOG_ERR, "common", "RBuffer almost flowed over without receiving a newline\n");
-			return -1;
-		}
+		lb->filled += i;
 
 		/* And try again in this loop ;) */
 	}
@@ -231,124 +429,107 @@ int sock_getline(SOCKET sock, char *rbuf, unsigned int rbuflen, unsigned int *fi
 	return -1;
 }
 
-/* Connect this client to a server */
-SOCKET connect_client(const char *hostname, const char *service, int family, int socktype)
+/*
+ * Start connecting to <addr>, the connect finishes in the background
+ * and the socket becomes writable when it is done
+ */
+SOCKET connect_client(int family, const struct sockaddr *addr, socklen_t addrlen)
 {
-	SOCKET		sock = -1;
-	struct addrinfo	hints, *res, *ressave;
+	SOCKET	sock;
+
+	sock = socket(family, SOCK_STREAM, 0);
+	if (sock == -1) return -1;
 
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = family;
-	hints.ai_socktype = socktype;
+	/* Enable non-blocking operation before connecting */
+	fcntl(sock, F_SETFL, O_NONBLOCK);
 
-	if (getaddrinfo(hostname, service, &hints, &res) != 0)
+	if (	connect(sock, addr, addrlen) != 0 &&
+		errno != EINPROGRESS)
 	{
-		dolog(LOG_ERR, "common", "Couldn't resolve host %s, service %s\n", hostname, service);
+		closesocket(sock);
 		return -1;
 	}
 
-	ressave = res;
+	return sock;
+}
 
-	while (res)
-	{
-		sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if (sock == -1) continue;
-		if (connect(sock, res->ai_addr, (unsigned int)res->ai_addrlen) == 0) break;
-		closesocket(sock);
-		sock = -1;
-		res = res->ai_next;
-	}
+/* A non-blocking socket listening on <addr>, -1 when that fails */
+SOCKET listen_server(int family, const struct sockaddr *addr, socklen_t addrlen)
+{
+	SOCKET	sock;
+	int	on = 1;
 
-	freeaddrinfo(ressave);
+	sock = socket(family, SOCK_STREAM, 0);
+	if (sock == -1) return -1;
 
-	/* Enable non-blocking operation */
+	if (family != AF_UNIX) setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 	fcntl(sock, F_SETFL, O_NONBLOCK);
 
+	if (	bind(sock, addr, addrlen) != 0 ||
+		listen(sock, 5) != 0)
+	{
+		closesocket(sock);
+		return -1;
+	}
+
 	return sock;
 }
 
-/* Count the number of fields in <s> */
-unsigned int countfields(char *s)
+/* Start iterating over the fields of <s> */
+void field_init(struct fielditer *it, const char *s)
 {
-	int	n = 1, i;
-	bool	hasquote = false;
-
-	if (s == NULL) return 0;
-	for (i=0; s[i] != '\0'; i++)
-	{
-		if (s[i] == '"')
-		{
-			hasquote = !hasquote;
-			continue;
-		}
-		if ( !hasquote && s[i] == ' ') n++;
-	}
-	return n;
+	it->next = s;
+	it->field = s;
+	it->len = 0;
 }
 
 /*
- * Copy <count> fields starting with <n> of string <s> into <buf> with a maximum of buflen
- * First field is 1
+ * Advance to the next space separated field of the string
+ * A field starting with a double quote runs up to the closing quote,
+ * the quotes themselves are not part of the span
+ * Returns false when there are no more fields
  */
-bool copyfields(char *s, unsigned int field, unsigned int count, char *buf, unsigned int buflen)
+bool field_next(struct fielditer *it)
 {
-	unsigned int begin = 0, i = 0, f = field, c = count;
-	bool hasquote = false;
-
-	/* Clear the buffer */
-	memset(buf, 0, buflen);
+	const char	*p = it->next, *e;
 
-	/* Copy at least 1 field */
-	if (c > 0) c--;
+	if (p == NULL || *p == '\0') return false;
 
-	while (s[i] != '\0')
+	if (*p == '"')
 	{
-		/*
-		 * When the beginning is not found yet update it
-		 * and proceed to the next field
-		 */
-		if (f > 0)
-		{
-			f--;
-			begin = i;
-		}
-		/* We found another field */
-		else if (c > 0) c--;
+		p++;
+		e = strchr(p, '"');
+		if (!e) e = p + strlen(p);
+		it->next = *e == '"' ? e + 1 : e;
+	}
+	else
+	{
+		e = strchr(p, ' ');
+		if (!e) e = p + strlen(p);
+		it->next = e;
+	}
 
-		for (;s[i] != '\0'; i++)
-		{
-			if (s[i] == '"')
-			{
-				if (hasquote)
-				{
-					hasquote = false;
-					break;
-				}
-				hasquote = true;
-				continue;
-			}
-			if (!hasquote && s[i] == ' ') break;
-		}
+	/* Skip the separator */
+	if (*it->next == ' ') it->next++;
 
-		if (f == 0 && (c == 0 || count == 0))
-		{
-			/* Skip the quote */
-			if (s[begin] == '"') begin++;
-			/* When only n fields where requested */
-			if (count != 0) i-=begin;
-			/* User wanted everything */
-			else i=(unsigned int)strlen(s)-begin;
-
-			/* Copy it to the supplied buffer as long as it fits */
-			strncpy(buf, s+begin, i > buflen ? buflen : i);
-#if 0
-			dolog(LOG_DEBUG, "common", "copyfield() : '%s', begin = %u, len = %u (\"%s\", f=%u, c=%u)\n", buf, begin, i, s, field, count);
-#endif
-			return true;
-		}
-		
-		i++;
-	}
-	dolog(LOG_WARNING, "common", "copyfield() - Field %u+%u didn't exist in '%s'\n", field, count, s);
-	return false;
+	it->field = p;
+	it->len = (unsigned int)(e - p);
+	return true;
+}
+
+/* Copy the current field into <buf>, truncating it when it doesn't fit */
+void field_copy(const struct fielditer *it, char *buf, unsigned int buflen)
+{
+	unsigned int len = it->len < buflen ? it->len : buflen - 1;
+
+	memcpy(buf, it->field, len);
+	buf[len] = '\0';
+}
+
+/* Advance to the next field and copy it into <buf> */
+bool field_copynext(struct fielditer *it, char *buf, unsigned int buflen)
+{
+	if (!field_next(it)) return false;
+	field_copy(it, buf, buflen);
+	return true;
 }
@@ -64,9 +64,73 @@ struct cfg_state
 	char		clientservice[NI_MAXSERV];	/* Service of the client */
 	char		user[200];			/* Username */
 
+	/* Sessions on a control socket only */
+	struct linebuf	rbuf;				/* Read buffer */
+	struct sendq	sendq;				/* Output waiting for the socket to become writable */
+	bool		sendq_exceeded;			/* Output was dropped, close the session */
+	time_t		connected;			/* When the session was accepted */
+	time_t		lastactive;			/* When the last command came in */
+	struct dlistnode node;				/* On cfg_sessions */
+
 	char		padding[3];			/* Padding */
 };
 
+/* A control socket, see cfg_conf_listen() */
+struct cfg_listener
+{
+	SOCKET		sock;				/* The listening socket */
+	int		protocol;			/* AF_* */
+	char		*name;				/* Path or host:port, for the logs */
+};
+
+#define CFG_SESSIONS 16					/* Control sessions at the same time */
+#define CFG_LOGIN_TIMEOUT 30				/* Seconds a session gets to authenticate */
+#define CFG_IDLE_TIMEOUT 900				/* Seconds an authenticated session may be idle */
+
+static struct list	*cfg_listeners = NULL;		/* struct cfg_listener */
+static struct dlist	cfg_sessions;			/* struct cfg_state */
+
+static void cfg_printf(struct cfg_state *cmd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/*
+ * Reply to the commander, lines for a session are queued and sent
+ * from the event loop, without a socket they go to the log
+ */
+static void cfg_printf(struct cfg_state *cmd, const char *fmt, ...)
+{
+	char		buf[BUFFERSIZE];
+	unsigned int	len;
+	bool		empty;
+	va_list		ap;
+
+	va_start(ap, fmt);
+
+	if (cmd->sock == -1)
+	{
+		dologA(LOG_INFO, "config", fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len >= sizeof(buf)) len = sizeof(buf)-1;
+
+	/* A client that doesn't read its replies gets cut off instead of piling them up */
+	if (cmd->sendq_exceeded) return;
+	if (sendq_depth(&cmd->sendq) + len > CFG_SENDQ_MAX)
+	{
+		log_err(config, "Control session from %s:%s doesn't read its replies, closing it\n",
+			cmd->clienthost, cmd->clientservice);
+		cmd->sendq_exceeded = true;
+		return;
+	}
+
+	empty = sendq_depth(&cmd->sendq) == 0;
+	if (!sendq_append(&cmd->sendq, buf, len)) return;
+	if (empty) event_defer(cmd->sock);
+}
+
 /********************************************************************
   Commands
 ********************************************************************/
@@ -75,37 +139,61 @@ bool cfg_misc_help(struct cfg_state *cmd, char *args);
 
 bool cfg_misc_reply(struct cfg_state *cmd, char *args)
 {
-	sock_printf(cmd->sock, "200 %s\n", args);
+	cfg_printf(cmd, "200 %s\n", args);
 	return true;
 }
 
 bool cfg_info_status(struct cfg_state *cmd, char *args)
 {
-	int	fields = countfields(args);
-	char	buf[42];
+	struct pool	*pool;
+	struct server	*srv;
+	struct listnode	*ln;
+
+	cfg_printf(cmd, "201 Status\n");
+	cfg_printf(cmd, "I am running ;)\n");
+
+	/* Allocator occupancy and churn */
+	POOL_LOOP(pool)
+	{
+		cfg_printf(cmd, "Pool %s: %u/%u used, peak %u, %u slabs, %" PRIu64 " allocs, %" PRIu64 " frees\n",
+			pool->name, pool->inuse, poolsize(pool), pool->peak,
+			pool->numslabs, pool->allocs, pool->frees);
+	}
+	cfg_printf(cmd, "Strings: %u interned\n", str_interned());
+	cfg_printf(cmd, "Log: dropped %" PRIu64 " error, %" PRIu64 " warning, %" PRIu64 " info, %" PRIu64 " debug lines\n",
+		log_dropped(LOG_ERR), log_dropped(LOG_WARNING), log_dropped(LOG_INFO), log_dropped(LOG_DEBUG));
 
-	sock_printf(cmd->sock, "201 Status\n", buf);
-	sock_printf(cmd->sock, "I am running ;)\n", buf);
-	sock_printf(cmd->sock, "202 Status complete\n", buf);
+	/* Links still being introduced to */
+	LIST_LOOP(g_conf->servers, srv, ln)
+	{
+		if (!srv->burst.active) continue;
+		cfg_printf(cmd, "Burst %s: %u steps in %u slices, at %s %s\n",
+			srv->tag, srv->burst.done, srv->burst.slices,
+			srv->burst.channel ? "channel" : "users",
+			srv->burst.channel ? ((struct channel *)srv->burst.channel->data)->name : "");
+	}
+
+	cfg_printf(cmd, "202 Status complete\n");
 	return true;
 }
 
 bool cfg_conf_set(struct cfg_state *cmd, char *args)
 {
-	int	fields = countfields(args);
-	char	var[50], val[1024], val2[1024], val3[1024];
+	struct fielditer	it;
+	unsigned int		fields = 2;
+	char			var[50], val[1024];
 
 	/* Require a value */
-	if (	fields < 2 ||
-		!copyfield(args, 1, var, sizeof(var)) ||
-		!copyfield(args, 2, val, sizeof(val)))
+	field_init(&it, args);
+	if (	!field_copynext(&it, var, sizeof(var)) ||
+		!field_copynext(&it, val, sizeof(val)))
 	{
-		sock_printf(cmd->sock, "400 The command is: set <variable> <value> [<value> ...]\n");
+		cfg_printf(cmd, "400 The command is: set <variable> <value> [<value> ...]\n");
 		return false;
 	}
 
-	if (fields > 2) copyfield(args, 3, val2, sizeof(val2));
-	if (fields > 3) copyfields(args, 4, 0, val3, sizeof(val3));
+	/* Count the remaining values */
+	while (field_next(&it)) fields++;
 
 	if (strcasecmp(var, "service_name") == 0 && fields == 2)
 	{
@@ -160,6 +248,25 @@ bool cfg_conf_set(struct cfg_state *cmd, char *args)
 		return true;
 	}
 
+	if (strcasecmp(var, "resolve_ttl") == 0 && fields == 2)
+	{
+		g_conf->resolve_ttl = atoi(val);
+		return true;
+	}
+
+	if (strcasecmp(var, "burst_lines") == 0 && fields == 2)
+	{
+		g_conf->burst_lines = atoi(val);
+		if (g_conf->burst_lines == 0) g_conf->burst_lines = 1;
+		return true;
+	}
+
+	if (strcasecmp(var, "burst_usec") == 0 && fields == 2)
+	{
+		g_conf->burst_usec = atoi(val);
+		return true;
+	}
+
 	if (strcasecmp(var, "verbose") == 0 && fields == 2)
 	{
 		if (	strcasecmp(val, "on") == 0 ||
@@ -168,7 +275,7 @@ bool cfg_conf_set(struct cfg_state *cmd, char *args)
 			g_conf->verbose = true;
 
 			/* Report back */
-			sock_printf(cmd->sock, "200 Verbosity Activated\n");
+			cfg_printf(cmd, "200 Verbosity Activated\n");
 			return true;
 		}
 		else if (strcasecmp(val, "off") == 0 ||
@@ -177,36 +284,48 @@ bool cfg_conf_set(struct cfg_state *cmd, char *args)
 			g_conf->verbose = true;
 
 			/* Report back */
-			sock_printf(cmd->sock, "200 Verbosity Disabled\n");
+			cfg_printf(cmd, "200 Verbosity Disabled\n");
+			return true;
+		}
+		cfg_printf(cmd, "400 verbose only accepts 'on' and 'off' and not '%s'\n", var);
+		return false;
+	}
+
+	if (strcasecmp(var, "log_categories") == 0 && fields == 2)
+	{
+		if (log_set_categories(val))
+		{
+			cfg_printf(cmd, "200 Debug output for %s\n", val);
 			return true;
 		}
-		sock_printf(cmd->sock, "400 verbose only accepts 'on' and 'off' and not '%s'\n", var);
+		cfg_printf(cmd, "400 log_categories takes 'all' or a list like 'server,channel,user'\n");
 		return false;
 	}
 
-	sock_printf(cmd->sock, "400 Unknown settable value '%s' with %u fields\n", var, fields);
+	cfg_printf(cmd, "400 Unknown settable value '%s' with %u fields\n", var, fields);
 	return false;
 }
 
 /* server add <servertag> <RFC1459|Timestamp|P10|User|BitlBee> <hostname> <service|portnumber> <nickname|none> <localname> <password|none> <identity> */
 bool cfg_conf_server_add(struct cfg_state *cmd, char *args)
 {
-	int		fields = countfields(args);
-	char		tag[25], type[10], hostname[24], service[24], nick[24], local[24], pass[24], identity[24];
-	enum srv_types	typ = SRV_BITLBEE;
+	struct fielditer	it;
+	char			tag[25], type[10], hostname[24], service[24], nick[24], local[24], pass[24], identity[24];
+	enum srv_types		typ = SRV_BITLBEE;
 
 	/* Add requires 8 variables */
-	if (	fields != 8 ||
-		!copyfield(args, 1, tag,	sizeof(tag)) ||
-		!copyfield(args, 2, type,	sizeof(type)) ||
-		!copyfield(args, 3, hostname,	sizeof(hostname)) ||
-		!copyfield(args, 4, service,	sizeof(service)) ||
-		!copyfield(args, 5, nick,	sizeof(nick)) ||
-		!copyfield(args, 6, local,	sizeof(local)) ||
-		!copyfield(args, 7, pass,	sizeof(pass)) ||
-		!copyfield(args, 8, identity,	sizeof(identity)))
-	{
-		sock_printf(cmd->sock, "400 The command is: server add <servertag> <RFC1459|Timestamp|P10|User|BitlBee> <hostname> <service|portnumber> <nickname|none> <localname> <password> <identity>\n");
+	field_init(&it, args);
+	if (	!field_copynext(&it, tag,	sizeof(tag)) ||
+		!field_copynext(&it, type,	sizeof(type)) ||
+		!field_copynext(&it, hostname,	sizeof(hostname)) ||
+		!field_copynext(&it, service,	sizeof(service)) ||
+		!field_copynext(&it, nick,	sizeof(nick)) ||
+		!field_copynext(&it, local,	sizeof(local)) ||
+		!field_copynext(&it, pass,	sizeof(pass)) ||
+		!field_copynext(&it, identity,	sizeof(identity)) ||
+		field_next(&it))
+	{
+		cfg_printf(cmd, "400 The command is: server add <servertag> <RFC1459|Timestamp|P10|User|BitlBee> <hostname> <service|portnumber> <nickname|none> <localname> <password> <identity>\n");
 		return false;
 	}
 
@@ -216,13 +335,13 @@ bool cfg_conf_server_add(struct cfg_state *cmd, char *args)
 	else if (strcasecmp(type, "user"	) == 0) typ = SRV_USER;
 	else
 	{
-		sock_printf(cmd->sock, "400 '%s' is an unsupported server type\n", type);
+		cfg_printf(cmd, "400 '%s' is an unsupported server type\n", type);
 		return false;
 	}
 	
 	if (server_find_tag(tag))
 	{
-		sock_printf(cmd->sock, "400 Server '%s' already exists\n", tag);
+		cfg_printf(cmd, "400 Server '%s' already exists\n", tag);
 		return false;
 	}
 
@@ -232,28 +351,29 @@ bool cfg_conf_server_add(struct cfg_state *cmd, char *args)
 		strcasecmp(pass, "none") == 0 ? NULL : pass,
 		identity, g_conf->service_description))
 	{
-		sock_printf(cmd->sock, "200 Added server %s\n", tag);
+		cfg_printf(cmd, "200 Added server %s\n", tag);
 		return true;
 	}
-	sock_printf(cmd->sock, "400 Server addition failed\n");
+	cfg_printf(cmd, "400 Server addition failed\n");
 	return false;
 }
 
 /* server set <servertag> <variable> <value> */
 bool cfg_conf_server_set(struct cfg_state *cmd, char *args)
 {
-	int		fields = countfields(args);
-	char		tag[25], var[25], val[1000];
-	struct server	*srv;
-	struct channel	*ch;
-
-	/* Add requires 8 variables */
-	if (	fields != 3 ||
-		!copyfield(args, 1, tag, sizeof(tag)) ||
-		!copyfield(args, 2, var, sizeof(var)) ||
-		!copyfield(args, 3, val, sizeof(val)))
+	struct fielditer	it;
+	char			tag[25], var[25], val[1000];
+	struct server		*srv;
+	struct channel		*ch;
+
+	/* Set requires 3 variables */
+	field_init(&it, args);
+	if (	!field_copynext(&it, tag, sizeof(tag)) ||
+		!field_copynext(&it, var, sizeof(var)) ||
+		!field_copynext(&it, val, sizeof(val)) ||
+		field_next(&it))
 	{
-		sock_printf(cmd->sock, "400 The command is: server set <servertag> <variable> <value>\n");
+		cfg_printf(cmd, "400 The command is: server set <servertag> <variable> <value>\n");
 		return false;
 	}
 
@@ -261,7 +381,7 @@ bool cfg_conf_server_set(struct cfg_state *cmd, char *args)
 
 	if (!srv)
 	{
-		sock_printf(cmd->sock, "400 Server '%s' does not exist\n");
+		cfg_printf(cmd, "400 Server '%s' does not exist\n", tag);
 		return false;
 	}
 
@@ -270,7 +390,17 @@ bool cfg_conf_server_set(struct cfg_state *cmd, char *args)
 		if (srv->bitlbee_identifypass) free(srv->bitlbee_identifypass);
 		srv->bitlbee_identifypass = strdup(val);
 		
-		sock_printf(cmd->sock, "200 Configured the BitlBee password\n");
+		cfg_printf(cmd, "200 Configured the BitlBee password\n");
+		return true;
+	}
+
+	if (strcasecmp(var, "maxtargets") == 0)
+	{
+		srv->maxtargets_conf = atoi(val);
+		if (srv->maxtargets_conf > MAXTARGETS_MAX) srv->maxtargets_conf = MAXTARGETS_MAX;
+
+		if (srv->maxtargets_conf) cfg_printf(cmd, "200 Sending up to %u targets per message\n", srv->maxtargets_conf);
+		else cfg_printf(cmd, "200 Sending as many targets per message as the server allows\n");
 		return true;
 	}
 
@@ -279,14 +409,14 @@ bool cfg_conf_server_set(struct cfg_state *cmd, char *args)
 		if (	srv->type != SRV_USER &&
 			srv->type != SRV_BITLBEE)
 		{
-			sock_printf(cmd->sock, "400 Defaultchannels are only required for user and BitlBee links\n", val);
+			cfg_printf(cmd, "400 Defaultchannels are only required for user and BitlBee links\n");
 			return false;
 		}
 
 		ch = channel_find_tag(val);
 		if (!ch)
 		{
-			sock_printf(cmd->sock, "400 Channel '%s' does not exist\n", val);
+			cfg_printf(cmd, "400 Channel '%s' does not exist\n", val);
 			return false;
 		}
 		srv->defaultchannel = ch;
@@ -294,27 +424,27 @@ bool cfg_conf_server_set(struct cfg_state *cmd, char *args)
 		/* Make sure that our user is also there */
 		channel_adduser(ch, srv->user);
 
-		sock_printf(cmd->sock, "200 Configured the default channel\n");
+		cfg_printf(cmd, "200 Configured the default channel\n");
 		return true;
 	}
 
-	sock_printf(cmd->sock, "400 Unknown settable value '%s'\n", var);
+	cfg_printf(cmd, "400 Unknown settable value '%s'\n", var);
 	return false;
 }
 
 /* server connect <servertag> */
 bool cfg_conf_server_connect(struct cfg_state *cmd, char *args)
 {
-	int		fields = countfields(args);
-	char		tag[25], var[25], val[1000];
-	struct server	*srv;
-	struct channel	*ch;
-
-	/* Add requires 1 variables */
-	if (	fields != 1 ||
-		!copyfield(args, 1, tag, sizeof(tag)))
+	struct fielditer	it;
+	char			tag[25];
+	struct server		*srv;
+
+	/* Connect requires 1 variable */
+	field_init(&it, args);
+	if (	!field_copynext(&it, tag, sizeof(tag)) ||
+		field_next(&it))
 	{
-		sock_printf(cmd->sock, "400 The command is: server connect <servertag>\n");
+		cfg_printf(cmd, "400 The command is: server connect <servertag>\n");
 		return false;
 	}
 
@@ -322,13 +452,13 @@ bool cfg_conf_server_connect(struct cfg_state *cmd, char *args)
 
 	if (!srv)
 	{
-		sock_printf(cmd->sock, "400 Server '%s' does not exist\n");
+		cfg_printf(cmd, "400 Server '%s' does not exist\n", tag);
 		return false;
 	}
 	
 	server_connect(srv);
 
-	sock_printf(cmd->sock, "200 Connecting to server\n");
+	cfg_printf(cmd, "200 Connecting to server\n");
 	return true;
 }
 
@@ -346,81 +476,83 @@ bool cfg_conf_server(struct cfg_state *cmd, char *args)
 	{
 		return cfg_conf_server_connect(cmd, &args[8]);
 	}
-	sock_printf(cmd->sock, "400 Unknown command\n");
+	cfg_printf(cmd, "400 Unknown command\n");
 	return false;
 }
 
 /* channel add <servertag> <channeltag> <name> */
 bool cfg_conf_channel_add(struct cfg_state *cmd, char *args)
 {
-	int		fields = countfields(args);
-	char		stag[24], ctag[24], name[24];
-	struct server	*srv;
+	struct fielditer	it;
+	char			stag[24], ctag[24], name[24];
+	struct server		*srv;
 
 	/* Add requires 3 variables */
-	if (	fields != 3 ||
-		!copyfield(args, 1, stag,	sizeof(stag)) ||
-		!copyfield(args, 2, ctag,	sizeof(ctag)) ||
-		!copyfield(args, 3, name,	sizeof(name)))
+	field_init(&it, args);
+	if (	!field_copynext(&it, stag,	sizeof(stag)) ||
+		!field_copynext(&it, ctag,	sizeof(ctag)) ||
+		!field_copynext(&it, name,	sizeof(name)) ||
+		field_next(&it))
 	{
-		sock_printf(cmd->sock, "400 The command is: channel add <servertag> <channeltag> <name>\n");
+		cfg_printf(cmd, "400 The command is: channel add <servertag> <channeltag> <name>\n");
 		return false;
 	}
 	
 	srv = server_find_tag(stag);
 	if (!srv)
 	{
-		sock_printf(cmd->sock, "400 Server '%s' does not exist\n", stag);
+		cfg_printf(cmd, "400 Server '%s' does not exist\n", stag);
 		return false;
 	}
 
 	if (channel_find_tag(ctag))
 	{
-		sock_printf(cmd->sock, "400 Channel '%s' does already exist\n", ctag);
+		cfg_printf(cmd, "400 Channel '%s' does already exist\n", ctag);
 		return false;
 	}
 
 	if (channel_add(srv, name, ctag))
 	{
-		sock_printf(cmd->sock, "200 Added channel %s\n", ctag);
+		cfg_printf(cmd, "200 Added channel %s\n", ctag);
 		return true;
 	}
-	sock_printf(cmd->sock, "400 Channel addition failed\n");
+	cfg_printf(cmd, "400 Channel addition failed\n");
 	return false;
 }
 
 /* channel link <channeltag> <channeltag> */
 bool cfg_conf_channel_link(struct cfg_state *cmd, char *args)
 {
-	int		fields = countfields(args);
-	char		tag_a[25], tag_b[25];
-	struct channel	*ch_a, *ch_b;
+	struct fielditer	it;
+	char			tag_a[25], tag_b[25];
+	struct channel		*ch_a, *ch_b;
 
 	/* Link requires 2 variables */
-	if (	fields != 2 ||
-		!copyfield(args, 1, tag_a, sizeof(tag_a)) ||
-		!copyfield(args, 2, tag_b, sizeof(tag_b)))
+	field_init(&it, args);
+	if (	!field_copynext(&it, tag_a, sizeof(tag_a)) ||
+		!field_copynext(&it, tag_b, sizeof(tag_b)) ||
+		field_next(&it))
 	{
-		sock_printf(cmd->sock, "400 The command is: channel link <channeltag> <channeltag>\n");
+		cfg_printf(cmd, "400 The command is: channel link <channeltag> <channeltag>\n");
 		return false;
 	}
 
 	ch_a = channel_find_tag(tag_a);
 	if (!ch_a)
 	{
-		sock_printf(cmd->sock, "400 Channel '%s' does not exist\n", tag_a);
+		cfg_printf(cmd, "400 Channel '%s' does not exist\n", tag_a);
 		return false;
 	}
 	ch_b = channel_find_tag(tag_b);
 	if (!ch_b)
 	{
-		sock_printf(cmd->sock, "400 Channel '%s' does not exist\n", tag_b);
+		cfg_printf(cmd, "400 Channel '%s' does not exist\n", tag_b);
 		return false;
 	}
 
 	channel_link(ch_a, ch_b);
 
-	sock_printf(cmd->sock, "200 Channels are linked\n");
+	cfg_printf(cmd, "200 Channels are linked\n");
 	return true;
 }
 
@@ -434,7 +566,7 @@ bool cfg_conf_channel(struct cfg_state *cmd, char *args)
 	{
 		return cfg_conf_channel_link(cmd, &args[5]);
 	}
-	sock_printf(cmd->sock, "400 Unknown command\n");
+	cfg_printf(cmd, "400 Unknown command\n");
 	return false;
 }
 
@@ -458,7 +590,7 @@ bool cfg_misc_quit(struct cfg_state *cmd, char *args)
 		"Tschau!",
 		"Ciao",
         };
-	sock_printf(cmd->sock, "200 %s\n", byers[random()%(sizeof(byers)/sizeof(char *))]);
+	cfg_printf(cmd, "200 %s\n", byers[random()%(sizeof(byers)/sizeof(char *))]);
 
 	/* Set the quit flag */
 	cmd->quit = true;
@@ -469,16 +601,17 @@ bool cfg_misc_quit(struct cfg_state *cmd, char *args)
 
 bool cfg_auth_login(struct cfg_state *cmd, char *args)
 {
-	unsigned char		secret[20] = "TheTalamasca", c, challenge[16];
-	unsigned int		i,r;
+	unsigned char		secret[20], challenge[16];
+	unsigned int		i;
 	struct MD5Context	md5;
-	int			fields = countfields(args);
+	struct fielditer	it;
 
 	/* Require a username */
-	if (fields != 1 ||
-		!copyfield(args, 1, cmd->user, sizeof(cmd->user)))
+	field_init(&it, args);
+	if (	!field_copynext(&it, cmd->user, sizeof(cmd->user)) ||
+		field_next(&it))
 	{
-		sock_printf(cmd->sock, "400 The command is: login <username>\n");
+		cfg_printf(cmd, "400 The command is: login <username>\n");
 		return false;
 	}
 
@@ -491,35 +624,26 @@ bool cfg_auth_login(struct cfg_state *cmd, char *args)
 		if (	cmd->user[i] < 'a' ||
 			cmd->user[i] > 'z')
 		{
-			sock_printf(cmd->sock, "400 Username contains unacceptable characters\n");
+			cfg_printf(cmd, "400 Username contains unacceptable characters\n");
 			return false;
 		}
 	}
 
-	/* Clear out the secret */
-	memset(secret, 0, sizeof(secret));
-
-	/* Randomize the string */
-	for (i=0; i < (sizeof(secret)-1); i++)
+	/*
+	 * The secret comes from the kernel, random() is predictable
+	 * and a predictable challenge allows replaying a response
+	 */
+	if (getrandom(secret, sizeof(secret), 0) != sizeof(secret))
 	{
-		/* Pick random number between 1 and 62 */
-		r = (random() % 63) + 1;
-
-		/* [ 1,10] => [0,9] */
-		if (r < 11)		c = (r+48-1);
-		/* [11,36] => [A,Z] */
-		else if (r < 37)	c = (r+65-10);
-		/* [37,62] => [a,z] */
-		else			c = (r+97-36);
-
-		/* Randomize */
-		secret[i] = c;
+		cfg_printf(cmd, "400 Couldn't generate a challenge\n");
+		return false;
 	}
 
 	/* Generate a MD5 */
 	MD5Init(&md5);
-	MD5Update(&md5, (const unsigned char *)&secret, (unsigned int)strlen((const char *)&secret));
+	MD5Update(&md5, secret, sizeof(secret));
 	MD5Final(challenge, &md5);
+	memset(secret, 0, sizeof(secret));
 
 	memset(&cmd->challenge, 0, sizeof(cmd->challenge));
 
@@ -530,7 +654,7 @@ bool cfg_auth_login(struct cfg_state *cmd, char *args)
         }
 
 	/* Return the challenge to the client */
-	sock_printf(cmd->sock, "200 %s\n", cmd->challenge);
+	cfg_printf(cmd, "200 %s\n", cmd->challenge);
 
 	/* Upgrade the level */
 	cmd->level = LEVEL_LOGIN;
@@ -541,15 +665,16 @@ bool cfg_auth_login(struct cfg_state *cmd, char *args)
 bool cfg_auth_authenticate(struct cfg_state *cmd, char *args)
 {
 	struct MD5Context	md5;
-	int			fields = countfields(args);
+	struct fielditer	it;
 	char			buf[256], res[256];
 	unsigned char		challenge[20];
 	int			i;
 
-	if (	fields != 1 ||
-		!copyfield(args, 1, buf, sizeof(buf)))
+	field_init(&it, args);
+	if (	!field_copynext(&it, buf, sizeof(buf)) ||
+		field_next(&it))
 	{
-		sock_printf(cmd->sock, "400 Command is: authenticate <response>\n");
+		cfg_printf(cmd, "400 Command is: authenticate <response>\n");
 		return false;
 	}
 
@@ -567,13 +692,17 @@ bool cfg_auth_authenticate(struct cfg_state *cmd, char *args)
                 snprintf(&res[i*2], 3, "%02x", challenge[i]);
         }
 
+	/* A challenge is good for one try only, after that login again */
+	memset(&cmd->challenge, 0, sizeof(cmd->challenge));
+
 	if (strcmp(buf, res) != 0)
 	{
-		sock_printf(cmd->sock, "400 Incorrect authentication token (user: '%s', us: '%s')\n", buf, res);
+		cmd->level = LEVEL_NONE;
+		cfg_printf(cmd, "400 Incorrect authentication token\n");
 		return false;
 	}
 
-	sock_printf(cmd->sock, "200 Welcome to The Talamasca (C) Copyright Jeroen Massar 2004 All Rights Reserved on %s\n", g_conf->service_name);
+	cfg_printf(cmd, "200 Welcome to The Talamasca (C) Copyright Jeroen Massar 2004 All Rights Reserved on %s\n", g_conf->service_name);
 
 	/*
 	 * The user logged in so set the level and title accordingly
@@ -584,6 +713,148 @@ bool cfg_auth_authenticate(struct cfg_state *cmd, char *args)
 	return true;
 }
 
+static void cfg_listen_event(SOCKET sock, unsigned int events, void *data);
+
+static void cfg_listener_free(struct cfg_listener *l)
+{
+	resolve_cancel(l);
+	if (l->sock != -1)
+	{
+		event_del(l->sock);
+		closesocket(l->sock);
+		if (l->protocol == AF_UNIX) unlink(l->name);
+	}
+	free(l->name);
+	free(l);
+}
+
+/* Start accepting sessions on <l> */
+static bool cfg_listener_start(struct cfg_listener *l, int family, const struct sockaddr *addr, socklen_t addrlen)
+{
+	l->sock = listen_server(family, addr, addrlen);
+	if (l->sock == -1) return false;
+
+	if (!event_add(l->sock, EV_READ, cfg_listen_event, l))
+	{
+		closesocket(l->sock);
+		l->sock = -1;
+		return false;
+	}
+
+	log_info(config, "Accepting control sessions on %s\n", l->name);
+	return true;
+}
+
+/* The address to listen on for a TCP control socket got resolved */
+static void cfg_listen_resolved(struct addrinfo *res, void *data)
+{
+	struct cfg_listener *l = (struct cfg_listener *)data;
+
+	for (; res; res = res->ai_next)
+	{
+		if (cfg_listener_start(l, res->ai_family, res->ai_addr, res->ai_addrlen)) return;
+	}
+
+	log_err(config, "Couldn't listen for control sessions on %s: %s (%d)\n", l->name, strerror(errno), errno);
+	listnode_delete(cfg_listeners, l);
+	cfg_listener_free(l);
+}
+
+/* listen tcp <host> <port> | listen unix <path> */
+bool cfg_conf_listen(struct cfg_state *cmd, char *args)
+{
+	struct fielditer	it;
+	struct cfg_listener	*l;
+	struct sockaddr_un	sun;
+	struct stat		st;
+	mode_t			mask;
+	bool			ok;
+	char			type[10], host[256], port[24] = "";
+
+	field_init(&it, args);
+	if (	!field_copynext(&it, type, sizeof(type)) ||
+		!field_copynext(&it, host, sizeof(host)) ||
+		(strcasecmp(type, "tcp") == 0 && !field_copynext(&it, port, sizeof(port))) ||
+		field_next(&it) ||
+		(strcasecmp(type, "tcp") != 0 && strcasecmp(type, "unix") != 0))
+	{
+		cfg_printf(cmd, "400 The command is: listen <tcp <host> <port>|unix <path>>\n");
+		return false;
+	}
+
+	if (!cfg_listeners)
+	{
+		cfg_listeners = list_new();
+		if (!cfg_listeners)
+		{
+			cfg_printf(cmd, "400 Not enough memory for the listener list\n");
+			return false;
+		}
+		cfg_listeners->del = (void(*)(void *))cfg_listener_free;
+	}
+
+	l = malloc(sizeof(*l));
+	if (!l)
+	{
+		cfg_printf(cmd, "400 Not enough memory for a listener\n");
+		return false;
+	}
+	memset(l, 0, sizeof(*l));
+	l->sock = -1;
+
+	if (strcasecmp(type, "unix") == 0)
+	{
+		memset(&sun, 0, sizeof(sun));
+		if (strlen(host) >= sizeof(sun.sun_path))
+		{
+			free(l);
+			cfg_printf(cmd, "400 The path %s is too long for a unix socket\n", host);
+			return false;
+		}
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, host);
+
+		l->protocol = AF_UNIX;
+		l->name = strdup(host);
+		listnode_add(cfg_listeners, l);
+
+		/* A stale socket from an earlier run would be in the way, but never remove anything else */
+		if (lstat(host, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(host);
+
+		/* Only for us, the password is the second line of defense */
+		mask = umask(0177);
+		ok = cfg_listener_start(l, AF_UNIX, (struct sockaddr *)&sun, sizeof(sun));
+		umask(mask);
+
+		if (!ok)
+		{
+			cfg_printf(cmd, "400 Couldn't listen on %s: %s (%d)\n", host, strerror(errno), errno);
+			listnode_delete(cfg_listeners, l);
+			cfg_listener_free(l);
+			return false;
+		}
+
+		cfg_printf(cmd, "200 Listening on %s\n", host);
+		return true;
+	}
+
+	l->protocol = AF_INET;
+	l->name = malloc(strlen(host) + strlen(port) + 2);
+	if (!l->name)
+	{
+		free(l);
+		cfg_printf(cmd, "400 Not enough memory for a listener\n");
+		return false;
+	}
+	sprintf(l->name, "%s:%s", host, port);
+	listnode_add(cfg_listeners, l);
+
+	/* Don't wait for the lookup, the socket gets opened once it is done */
+	cfg_printf(cmd, "200 Listening on %s once it is resolved\n", l->name);
+	resolve(host, port, AF_UNSPEC, SOCK_STREAM, cfg_listen_resolved, l);
+	return true;
+}
+
 /* Commands as seen above */
 struct {
 	char		*cmd;
@@ -603,6 +874,7 @@ struct {
 	/* Configuration */	
 	{"server",		LEVEL_CONFIG,	cfg_conf_server,	"server add <servertag> <RFC1459|Timestamp|P10|User|BitlBee> <hostname> <service|portnumber> <nickname|none> <localname> <password|none> <identity>"},
 	{"channel",		LEVEL_CONFIG,	cfg_conf_channel,	"channel (add <servertag> <channeltag> <name>|link <chantag> <chantag>)"},
+	{"listen",		LEVEL_CONFIG,	cfg_conf_listen,	"listen <tcp <host> <port>|unix <path>>"},
 
 	/* Misc commands */
 	{"reply",		LEVEL_AUTH,	cfg_misc_reply,		"reply [text]"},
@@ -615,7 +887,7 @@ bool cfg_misc_help(struct cfg_state *cmd, char *args)
 {
 	int i=0;
 
-	sock_printf(cmd->sock, "201 The following commands are available:\n");
+	cfg_printf(cmd, "201 The following commands are available:\n");
 	for (i=0; cfg_cmds[i].cmd; i++)
 	{
 		/*
@@ -625,9 +897,9 @@ bool cfg_misc_help(struct cfg_state *cmd, char *args)
 		if (	cfg_cmds[i].func == NULL ||
 			cfg_cmds[i].level > cmd->level) continue;
 
-		sock_printf(cmd->sock, "%-20s %s\n", cfg_cmds[i].cmd, cfg_cmds[i].desc);
+		cfg_printf(cmd, "%-20s %s\n", cfg_cmds[i].cmd, cfg_cmds[i].desc);
 	}
-	sock_printf(cmd->sock, "202 End of Help\n");
+	cfg_printf(cmd, "202 End of Help\n");
 	return true;
 }
 
@@ -645,7 +917,7 @@ bool cfg_handlecommand(struct cfg_state *cmd, char *command)
 		 * We don't output anything for these when we are not bound
 		 * to a socket
 		 */
-		if (cmd->sock != -1) sock_printf(cmd->sock, "200 Ignoring...\n");
+		if (cmd->sock != -1) cfg_printf(cmd, "200 Ignoring...\n");
 		return true;
 	}
 
@@ -659,12 +931,12 @@ bool cfg_handlecommand(struct cfg_state *cmd, char *command)
 			(command[len] != ' ' && command[len] != '\0')) continue;
 		if (cfg_cmds[i].func == NULL)
 		{
-			sock_printf(cmd->sock, "200 Ignoring...\n");
+			cfg_printf(cmd, "200 Ignoring...\n");
 			return true;
 		}
-		else return cfg_cmds[i].func(cmd, &command[len+1]);
+		else return cfg_cmds[i].func(cmd, command[len] ? &command[len+1] : &command[len]);
 	}
-	sock_printf(cmd->sock, "400 Command unknown '%s'\n", command);
+	cfg_printf(cmd, "400 Command unknown '%s'\n", command);
 	return false;
 }
 
@@ -680,11 +952,11 @@ bool cfg_fromfile(struct cfg_state *cmd, char *filename)
 	file = fopen(filename, "r");
 	if (file == NULL)
 	{
-		sock_printf(cmd->sock, "Couldn't open configuration file %s (%d): %s\n", filename, errno, strerror(errno));
+		cfg_printf(cmd, "Couldn't open configuration file %s (%d): %s\n", filename, errno, strerror(errno));
 		return false;
 	}
 
-	sock_printf(cmd->sock, "Configuring from file %s\n", filename);
+	cfg_printf(cmd, "Configuring from file %s\n", filename);
 	
 	/* Walk through the file line by line */
 	while (	!cmd->quit &&
@@ -699,7 +971,7 @@ bool cfg_fromfile(struct cfg_state *cmd, char *filename)
 		if (buf[n] == '\n') {buf[n] = '\0'; n--;}
 		if (buf[n] == '\r') {buf[n] = '\0'; n--;}
 
-		sock_printf(cmd->sock, "Line %u: %s\n", line, buf);
+		cfg_printf(cmd, "Line %u: %s\n", line, buf);
 
 		ret = cfg_handlecommand(cmd, buf);
 		if (!ret) break;
@@ -707,7 +979,7 @@ bool cfg_fromfile(struct cfg_state *cmd, char *filename)
 		line++;
 	}
 
-	sock_printf(cmd->sock, "Configuration file parsing complete\n");
+	cfg_printf(cmd, "Configuration file parsing complete\n");
 
 	/* Close the file */
 	fclose(file);
@@ -719,7 +991,7 @@ bool cfg_fromfile_direct(char *file)
 	struct cfg_state cmd;
 	memset(&cmd, 0, sizeof(cmd));
 
-	/* Use dolog() as the output channel */
+	/* Use the log as the output channel */
 	cmd.sock = -1;
 
 	/*
@@ -732,3 +1004,182 @@ bool cfg_fromfile_direct(char *file)
 	/* Run it */
 	return (cfg_fromfile(&cmd, file) && !cmd.quit);
 }
+
+/********************************************************************
+  Control sessions
+********************************************************************/
+
+static void cfg_session_close(struct cfg_state *cmd)
+{
+	log_info(config, "Control session from %s:%s closed\n", cmd->clienthost, cmd->clientservice);
+
+	event_del(cmd->sock);
+	closesocket(cmd->sock);
+	sendq_free(&cmd->sendq);
+	dlist_unlink(&cfg_sessions, &cmd->node);
+	free(cmd);
+}
+
+/* Called from the event loop when the socket of a session is ready */
+static void cfg_session_event(SOCKET sock, unsigned int events, void *data)
+{
+	struct cfg_state	*cmd = (struct cfg_state *)data;
+	char			*line;
+	unsigned int		linelen;
+	int			i;
+
+	/* Send the replies, as far as the client takes them */
+	if (events & (EV_WRITE|EV_FLUSH))
+	{
+		if (sendq_flush(sock, &cmd->sendq) < 0)
+		{
+			cfg_session_close(cmd);
+			return;
+		}
+	}
+
+	/* Handle the commands that came in, nothing more after a quit */
+	if (events & (EV_READ|EV_ERROR) && !cmd->quit)
+	{
+		while ((i = sock_getline(sock, &cmd->rbuf, &line, &linelen)) > 0)
+		{
+			cmd->lastactive = time(NULL);
+			cfg_handlecommand(cmd, line);
+			if (cmd->quit || cmd->sendq_exceeded) break;
+		}
+		if (i < 0)
+		{
+			cfg_session_close(cmd);
+			return;
+		}
+	}
+
+	/* Done talking and everything sent, or not reading at all */
+	if (	cmd->sendq_exceeded ||
+		(cmd->quit && sendq_depth(&cmd->sendq) == 0))
+	{
+		cfg_session_close(cmd);
+		return;
+	}
+
+	/* Only wait for writability while there is something to write */
+	event_modify(sock,	(cmd->quit ? 0 : EV_READ) |
+				(sendq_depth(&cmd->sendq) > 0 ? EV_WRITE : 0));
+}
+
+/* Called from the event loop when somebody connects to a control socket */
+static void cfg_listen_event(SOCKET sock, unsigned int events, void *data)
+{
+	struct cfg_listener	*l = (struct cfg_listener *)data;
+	struct cfg_state	*cmd;
+	struct sockaddr_storage	sa;
+	socklen_t		salen;
+	SOCKET			s;
+
+	for (;;)
+	{
+		salen = sizeof(sa);
+		s = accept(sock, (struct sockaddr *)&sa, &salen);
+		if (s == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				log_err(config, "Couldn't accept a control session on %s: %s (%d)\n", l->name, strerror(errno), errno);
+			}
+			return;
+		}
+
+		if (cfg_sessions.count >= CFG_SESSIONS)
+		{
+			log_err(config, "Too many control sessions, refusing one on %s\n", l->name);
+			closesocket(s);
+			continue;
+		}
+
+		cmd = malloc(sizeof(*cmd));
+		if (!cmd)
+		{
+			log_err(config, "Not enough memory for a control session\n");
+			closesocket(s);
+			continue;
+		}
+		memset(cmd, 0, sizeof(*cmd));
+		fcntl(s, F_SETFL, O_NONBLOCK);
+
+		cmd->sock	= s;
+		cmd->protocol	= l->protocol;
+		cmd->level	= LEVEL_NONE;
+		cmd->connected	= cmd->lastactive = time(NULL);
+		linebuf_reset(&cmd->rbuf);
+
+		if (l->protocol == AF_UNIX)
+		{
+			snprintf(cmd->clienthost, sizeof(cmd->clienthost), "%s", l->name);
+			snprintf(cmd->clientservice, sizeof(cmd->clientservice), "%d", s);
+		}
+		else getnameinfo((struct sockaddr *)&sa, salen,
+			cmd->clienthost, sizeof(cmd->clienthost),
+			cmd->clientservice, sizeof(cmd->clientservice),
+			NI_NUMERICHOST|NI_NUMERICSERV);
+
+		if (!event_add(s, EV_READ, cfg_session_event, cmd))
+		{
+			closesocket(s);
+			free(cmd);
+			continue;
+		}
+		dlist_add(&cfg_sessions, &cmd->node, cmd);
+
+		log_info(config, "Control session from %s:%s\n", cmd->clienthost, cmd->clientservice);
+		cfg_printf(cmd, "200 The Talamasca (C) Copyright Jeroen Massar 2004 All Rights Reserved on %s\n", g_conf->service_name);
+	}
+}
+
+/*
+ * Close sessions that didn't authenticate in time or that are idle,
+ * otherwise a few idle connections would take all CFG_SESSIONS slots
+ */
+void cfg_timeout(time_t now)
+{
+	struct cfg_state	*cmd;
+	struct dlistnode	*dn, *dn2;
+
+	DLIST_LOOP2(&cfg_sessions, cmd, dn, dn2)
+	{
+		if (cmd->level < LEVEL_AUTH)
+		{
+			if (now <= cmd->connected + CFG_LOGIN_TIMEOUT) continue;
+			log_warn(config, "Control session from %s:%s didn't authenticate in time\n",
+				cmd->clienthost, cmd->clientservice);
+			cfg_printf(cmd, "400 Authentication timed out\n");
+		}
+		else
+		{
+			if (now <= cmd->lastactive + CFG_IDLE_TIMEOUT) continue;
+			log_info(config, "Control session from %s:%s is idle\n",
+				cmd->clienthost, cmd->clientservice);
+			cfg_printf(cmd, "400 Idle for too long\n");
+		}
+
+		/* Whatever the client takes right now, no waiting for it */
+		sendq_flush(cmd->sock, &cmd->sendq);
+		cfg_session_close(cmd);
+	}
+	DLIST_LOOP2_END
+}
+
+/* Close the control sockets and their sessions */
+void cfg_exit()
+{
+	struct cfg_state	*cmd;
+	struct dlistnode	*dn, *dn2;
+
+	DLIST_LOOP2(&cfg_sessions, cmd, dn, dn2)
+	{
+		cfg_session_close(cmd);
+	}
+	DLIST_LOOP2_END
+
+	if (cfg_listeners) list_delete(cfg_listeners);
+	cfg_listeners = NULL;
+}
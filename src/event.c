@@ -0,0 +1,255 @@
+/******************************************************
+ Talamasca
+ by Jeroen Massar <jeroen@unfix.org>
+ (C) Copyright Jeroen Massar 2004 All Rights Reserved
+ http://unfix.org/projects/talamasca/
+*******************************************************
+ $Author: $
+ $Id: $
+ $Date: $
+*******************************************************
+ Event loop (epoll based socket reactor)
+******************************************************/
+
+#include "talamasca.h"
+
+/* Maximum number of events handled per epoll_wait() */
+#define EVENT_MAXREADY 64
+
+/* Convert our EV_* flags into epoll flags */
+static unsigned int event_toepoll(unsigned int events)
+{
+	unsigned int e = 0;
+
+	if (events & EV_READ)	e |= EPOLLIN;
+	if (events & EV_WRITE)	e |= EPOLLOUT;
+
+	return e;
+}
+
+bool event_init()
+{
+	g_conf->epoll = epoll_create(EVENT_MAXREADY);
+	if (g_conf->epoll == -1)
+	{
+		log_err(event, "Couldn't create epoll descriptor: %s (%d)\n", strerror(errno), errno);
+		return false;
+	}
+
+	g_conf->events		= NULL;
+	g_conf->numevents	= 0;
+	g_conf->deferred	= NULL;
+	g_conf->numdeferred	= 0;
+	g_conf->sizedeferred	= 0;
+	return true;
+}
+
+void event_exit()
+{
+	if (g_conf->epoll != -1) close(g_conf->epoll);
+	g_conf->epoll = -1;
+
+	if (g_conf->events) free(g_conf->events);
+	g_conf->events		= NULL;
+	g_conf->numevents	= 0;
+
+	if (g_conf->deferred) free(g_conf->deferred);
+	g_conf->deferred	= NULL;
+	g_conf->numdeferred	= 0;
+	g_conf->sizedeferred	= 0;
+}
+
+/* Register a handler for <sock>, called when one of <events> happens */
+bool event_add(SOCKET sock, unsigned int events, void (*handler)(SOCKET sock, unsigned int events, void *data), void *data)
+{
+	struct epoll_event	ev;
+	struct event		*evs;
+	unsigned int		num;
+
+	if (sock < 0 || !handler)
+	{
+		log_err(event, "event_add() - Something passed me an invalid socket or handler\n");
+		return false;
+	}
+
+	/* Grow the handler table when this socket doesn't fit */
+	if ((unsigned int)sock >= g_conf->numevents)
+	{
+		num = (sock + EVENT_MAXREADY) & ~(EVENT_MAXREADY-1);
+		evs = realloc(g_conf->events, num * sizeof(*evs));
+		if (!evs)
+		{
+			log_err(event, "Not enough memory left to grow the event table!?\n");
+			return false;
+		}
+		memset(&evs[g_conf->numevents], 0, (num - g_conf->numevents) * sizeof(*evs));
+		g_conf->events		= evs;
+		g_conf->numevents	= num;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events	= event_toepoll(events);
+	ev.data.fd	= sock;
+
+	if (epoll_ctl(g_conf->epoll, EPOLL_CTL_ADD, sock, &ev) != 0)
+	{
+		log_err(event, "Couldn't add socket %d to epoll: %s (%d)\n", sock, strerror(errno), errno);
+		return false;
+	}
+
+	g_conf->events[sock].events	= events;
+	g_conf->events[sock].handler	= handler;
+	g_conf->events[sock].data	= data;
+
+	return true;
+}
+
+/* Change the events we want to know about for <sock> */
+bool event_modify(SOCKET sock, unsigned int events)
+{
+	struct epoll_event ev;
+
+	if (	sock < 0 ||
+		(unsigned int)sock >= g_conf->numevents ||
+		!g_conf->events[sock].handler)
+	{
+		log_err(event, "event_modify() - Socket %d is not registered\n", sock);
+		return false;
+	}
+
+	/* Nothing changed? */
+	if (g_conf->events[sock].events == events) return true;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events	= event_toepoll(events);
+	ev.data.fd	= sock;
+
+	if (epoll_ctl(g_conf->epoll, EPOLL_CTL_MOD, sock, &ev) != 0)
+	{
+		log_err(event, "Couldn't modify socket %d in epoll: %s (%d)\n", sock, strerror(errno), errno);
+		return false;
+	}
+
+	g_conf->events[sock].events = events;
+	return true;
+}
+
+/* Stop watching <sock>, must be called before closing it */
+void event_del(SOCKET sock)
+{
+	struct epoll_event ev;
+
+	if (	sock < 0 ||
+		(unsigned int)sock >= g_conf->numevents ||
+		!g_conf->events[sock].handler) return;
+
+	/* Older kernels require a non-NULL event */
+	memset(&ev, 0, sizeof(ev));
+	epoll_ctl(g_conf->epoll, EPOLL_CTL_DEL, sock, &ev);
+
+	/*
+	 * Clearing the handler also makes sure that events for this
+	 * socket which are still pending in this round are skipped
+	 */
+	memset(&g_conf->events[sock], 0, sizeof(g_conf->events[sock]));
+}
+
+/*
+ * Ask for an EV_FLUSH call of the handler of <sock> before the loop
+ * goes to sleep again. This allows collecting all the output generated
+ * while handling the ready sockets and sending it in one go.
+ */
+void event_defer(SOCKET sock)
+{
+	SOCKET		*d;
+	unsigned int	num;
+
+	if (	sock < 0 ||
+		(unsigned int)sock >= g_conf->numevents ||
+		!g_conf->events[sock].handler ||
+		g_conf->events[sock].deferred) return;
+
+	if (g_conf->numdeferred >= g_conf->sizedeferred)
+	{
+		num = g_conf->sizedeferred ? g_conf->sizedeferred * 2 : EVENT_MAXREADY;
+		d = realloc(g_conf->deferred, num * sizeof(*d));
+		if (!d)
+		{
+			log_err(event, "Not enough memory left to grow the deferred table!?\n");
+			return;
+		}
+		g_conf->deferred	= d;
+		g_conf->sizedeferred	= num;
+	}
+
+	g_conf->events[sock].deferred = true;
+	g_conf->deferred[g_conf->numdeferred++] = sock;
+}
+
+/* Call the handlers of the deferred sockets */
+static void event_flush()
+{
+	struct event	*ev;
+	unsigned int	i;
+	SOCKET		sock;
+
+	/* Handlers might defer again, those are handled in this same pass */
+	for (i=0; i < g_conf->numdeferred; i++)
+	{
+		sock = g_conf->deferred[i];
+
+		/* Removed in the mean time? */
+		if ((unsigned int)sock >= g_conf->numevents) continue;
+		ev = &g_conf->events[sock];
+		if (!ev->handler || !ev->deferred) continue;
+
+		ev->deferred = false;
+		ev->handler(sock, EV_FLUSH, ev->data);
+	}
+	g_conf->numdeferred = 0;
+}
+
+/*
+ * Wait at most <timeout> milliseconds for sockets to become ready
+ * and call the handlers of only those sockets.
+ * Returns the number of sockets handled or -1 on failure
+ */
+int event_loop(int timeout)
+{
+	struct epoll_event	ready[EVENT_MAXREADY];
+	struct event		*ev;
+	unsigned int		events;
+	int			i, n;
+	SOCKET			sock;
+
+	/* Send out everything that was generated since the last round */
+	event_flush();
+
+	n = epoll_wait(g_conf->epoll, ready, EVENT_MAXREADY, timeout);
+	if (n < 0)
+	{
+		if (errno == EINTR) return 0;
+		log_err(event, "epoll_wait failed: %s (%d)\n", strerror(errno), errno);
+		return -1;
+	}
+
+	for (i=0; i < n; i++)
+	{
+		sock = ready[i].data.fd;
+
+		/* Removed by an earlier handler in this round? */
+		if ((unsigned int)sock >= g_conf->numevents) continue;
+		ev = &g_conf->events[sock];
+		if (!ev->handler) continue;
+
+		events = 0;
+		/* A hangup can still have data queued, let the reader find the EOF */
+		if (ready[i].events & (EPOLLIN|EPOLLHUP))	events |= EV_READ;
+		if (ready[i].events & EPOLLOUT)			events |= EV_WRITE;
+		if (ready[i].events & EPOLLERR)			events |= EV_ERROR;
+
+		ev->handler(sock, events, ev->data);
+	}
+
+	return n;
+}
@@ -0,0 +1,236 @@
+/* Generic hash table routines.
+ * by Jeroen Massar for talamasca
+ */
+
+#include "hash.h"
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* Initial number of buckets, always a power of 2 */
+#define HASH_INITSIZE 64
+
+/* Allocate a new hash. */
+struct hash *hash_new(int (*cmp)(const void *data, const void *match))
+{
+	struct hash *hash;
+
+	hash = malloc(sizeof(struct hash));
+	if (!hash) return NULL;
+	memset(hash, 0, sizeof(struct hash));
+
+	hash->index = malloc(HASH_INITSIZE * sizeof(struct hashnode *));
+	if (!hash->index)
+	{
+		free(hash);
+		return NULL;
+	}
+	memset(hash->index, 0, HASH_INITSIZE * sizeof(struct hashnode *));
+	hash->size = HASH_INITSIZE;
+	hash->cmp = cmp;
+	return hash;
+}
+
+/* Free the hash and all its nodes, not the data. */
+void hash_free(struct hash *hash)
+{
+	struct hashnode	*node, *next;
+	unsigned int	i;
+
+	if (!hash) return;
+
+	for (i = 0; i < hash->size; i++)
+	{
+		for (node = hash->index[i]; node; node = next)
+		{
+			next = node->next;
+			free(node);
+		}
+	}
+	free(hash->index);
+	free(hash);
+}
+
+/* Double the number of buckets when the chains get long. */
+static void hash_grow(struct hash *hash)
+{
+	struct hashnode	**index, *node, *next;
+	unsigned int	i, size = hash->size * 2;
+
+	index = malloc(size * sizeof(struct hashnode *));
+	/* No memory? Then the chains simply become longer */
+	if (!index) return;
+	memset(index, 0, size * sizeof(struct hashnode *));
+
+	for (i = 0; i < hash->size; i++)
+	{
+		for (node = hash->index[i]; node; node = next)
+		{
+			next = node->next;
+			node->next = index[node->key & (size-1)];
+			index[node->key & (size-1)] = node;
+		}
+	}
+
+	free(hash->index);
+	hash->index = index;
+	hash->size = size;
+}
+
+/* Add data under key. */
+void hash_add(struct hash *hash, unsigned int key, void *data)
+{
+	struct hashnode *node;
+
+	if (hash->count >= hash->size) hash_grow(hash);
+
+	node = malloc(sizeof(struct hashnode));
+	if (!node) return;
+
+	node->key = key;
+	node->data = data;
+	node->next = hash->index[key & (hash->size-1)];
+	hash->index[key & (hash->size-1)] = node;
+	hash->count++;
+}
+
+/* Find the data stored under key for which cmp(data, match) returns 0. */
+void *hash_find(struct hash *hash, unsigned int key, const void *match)
+{
+	struct hashnode *node;
+
+	for (node = hash->index[key & (hash->size-1)]; node; node = node->next)
+	{
+		if (node->key == key && hash->cmp(node->data, match) == 0) return node->data;
+	}
+	return NULL;
+}
+
+/* Delete the specific data pointer stored under key. */
+void hash_delete(struct hash *hash, unsigned int key, void *data)
+{
+	struct hashnode **prev, *node;
+
+	for (prev = &hash->index[key & (hash->size-1)]; (node = *prev); prev = &node->next)
+	{
+		if (node->data != data) continue;
+
+		*prev = node->next;
+		free(node);
+		hash->count--;
+		return;
+	}
+}
+
+/* Initial number of slots of a ptrhash, always a power of 2 */
+#define PTRHASH_INITSIZE 8
+
+/* Slot to start probing for key at */
+static unsigned int ptrhash_slot(struct ptrhash *hash, const void *key)
+{
+	/* Fibonacci hashing, the low bits of pointers are mostly zero */
+	return (unsigned int)((((uintptr_t)key) >> 3) * 2654435761U) & (hash->size-1);
+}
+
+/* Initialize an empty ptrhash, it allocates on the first add. */
+void ptrhash_init(struct ptrhash *hash)
+{
+	memset(hash, 0, sizeof(*hash));
+}
+
+/* Remove everything from the ptrhash, not the data. */
+void ptrhash_clear(struct ptrhash *hash)
+{
+	if (hash->slots) free(hash->slots);
+	ptrhash_init(hash);
+}
+
+/* Resize to size slots and put all the entries back. */
+static int ptrhash_resize(struct ptrhash *hash, unsigned int size)
+{
+	struct ptrslot	*old = hash->slots;
+	unsigned int	i, j, oldsize = hash->size;
+
+	hash->slots = malloc(size * sizeof(struct ptrslot));
+	if (!hash->slots)
+	{
+		hash->slots = old;
+		return 0;
+	}
+	memset(hash->slots, 0, size * sizeof(struct ptrslot));
+	hash->size = size;
+
+	for (i = 0; i < oldsize; i++)
+	{
+		if (!old[i].key) continue;
+		for (j = ptrhash_slot(hash, old[i].key); hash->slots[j].key; j = (j+1) & (size-1));
+		hash->slots[j] = old[i];
+	}
+
+	if (old) free(old);
+	return 1;
+}
+
+/* Add data under key, a key can only be added once. */
+int ptrhash_add(struct ptrhash *hash, const void *key, void *data)
+{
+	unsigned int i;
+
+	/* Keep the load under 3/4 so the probes stay short */
+	if ((hash->count+1) * 4 > hash->size * 3 &&
+		!ptrhash_resize(hash, hash->size ? hash->size * 2 : PTRHASH_INITSIZE)) return 0;
+
+	for (i = ptrhash_slot(hash, key); hash->slots[i].key; i = (i+1) & (hash->size-1))
+	{
+		if (hash->slots[i].key == key) return 0;
+	}
+	hash->slots[i].key = key;
+	hash->slots[i].data = data;
+	hash->count++;
+	return 1;
+}
+
+/* Find the data stored under key. */
+void *ptrhash_find(struct ptrhash *hash, const void *key)
+{
+	unsigned int i;
+
+	if (hash->count == 0) return NULL;
+
+	for (i = ptrhash_slot(hash, key); hash->slots[i].key; i = (i+1) & (hash->size-1))
+	{
+		if (hash->slots[i].key == key) return hash->slots[i].data;
+	}
+	return NULL;
+}
+
+/* Delete key, moving later entries of the probe chain back into the hole. */
+void ptrhash_delete(struct ptrhash *hash, const void *key)
+{
+	unsigned int i, j, k;
+
+	if (hash->count == 0) return;
+
+	for (i = ptrhash_slot(hash, key); hash->slots[i].key != key; i = (i+1) & (hash->size-1))
+	{
+		if (!hash->slots[i].key) return;
+	}
+
+	hash->slots[i].key = NULL;
+	hash->slots[i].data = NULL;
+	hash->count--;
+
+	for (j = (i+1) & (hash->size-1); hash->slots[j].key; j = (j+1) & (hash->size-1))
+	{
+		k = ptrhash_slot(hash, hash->slots[j].key);
+
+		/* Can the entry at j stay, ie is its home slot k cyclically in (i,j]? */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+
+		hash->slots[i] = hash->slots[j];
+		hash->slots[j].key = NULL;
+		hash->slots[j].data = NULL;
+		i = j;
+	}
+}
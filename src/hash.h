@@ -0,0 +1,72 @@
+/*
+ * Generic hash table
+ * Keys are computed by the caller, entries are matched
+ * using the compare function given at creation time
+ * by Jeroen Massar for talamasca
+ */
+
+#ifndef __HASH_H
+#define __HASH_H
+
+struct hashnode
+{
+	struct hashnode	*next;
+	unsigned int	key;
+	void		*data;
+};
+
+struct hash
+{
+	struct hashnode	**index;
+	unsigned int	size;
+	unsigned int	count;
+	int		(*cmp)(const void *data, const void *match);
+};
+
+#define hashcount(X)	((X)->count)
+
+/* Prototypes. */
+struct hash	*hash_new(int (*cmp)(const void *data, const void *match));
+void		hash_free(struct hash *);
+void		hash_add(struct hash *, unsigned int key, void *data);
+void		*hash_find(struct hash *, unsigned int key, const void *match);
+void		hash_delete(struct hash *, unsigned int key, void *data);
+
+/* Hash iteration macro, the current entry may not be deleted */
+#define HASH_LOOP(H,V,I,N) \
+  for ((I) = 0; (I) < (H)->size; (I)++) \
+    for ((N) = (H)->index[(I)]; (N); (N) = (N)->next) \
+      if (((V) = (N)->data) != NULL)
+
+/*
+ * Open addressing index keyed on pointers
+ * Meant to be embedded, thus needs no allocation per entry
+ */
+struct ptrslot
+{
+	const void	*key;
+	void		*data;
+};
+
+struct ptrhash
+{
+	struct ptrslot	*slots;
+	unsigned int	size;
+	unsigned int	count;
+};
+
+#define ptrhashcount(X)	((X)->count)
+
+/* Prototypes. */
+void		ptrhash_init(struct ptrhash *);
+void		ptrhash_clear(struct ptrhash *);
+int		ptrhash_add(struct ptrhash *, const void *key, void *data);
+void		*ptrhash_find(struct ptrhash *, const void *key);
+void		ptrhash_delete(struct ptrhash *, const void *key);
+
+/* Iterate over the data, no entries may be added or deleted meanwhile */
+#define PTRHASH_LOOP(H,V,I) \
+  for ((I) = 0; (I) < (H)->size; (I)++) \
+    if (((V) = (H)->slots[(I)].data) != NULL)
+
+#endif /* __HASH_H */
@@ -0,0 +1,116 @@
+/******************************************************
+ Talamasca
+ by Jeroen Massar <jeroen@unfix.org>
+ (C) Copyright Jeroen Massar 2004 All Rights Reserved
+ http://unfix.org/projects/talamasca/
+*******************************************************
+ $Author: $
+ $Id: $
+ $Date: $
+*******************************************************
+ String interning
+
+ Lots of users share the same ident, host or realname,
+ eg all the contacts behind one BitlBee gateway. These
+ strings are thus stored only once and refcounted.
+ Equal interned strings are the same pointer.
+******************************************************/
+
+#include "talamasca.h"
+
+/* An interned string, str is what the callers get */
+struct istring
+{
+	unsigned int	refs;		/* Number of holders */
+	unsigned int	key;		/* Hash key of str */
+	char		str[1];		/* The string itself */
+};
+
+/* From the pointer handed out back to the istring */
+#define istring_of(S)	((struct istring *)((S) - offsetof(struct istring, str)))
+
+/* All the interned strings (struct istring) */
+static struct hash *intern_table = NULL;
+
+static int intern_cmp(const void *data, const void *str)
+{
+	return strcmp(((const struct istring *)data)->str, (const char *)str);
+}
+
+/* FNV-1a, case sensitive */
+static unsigned int intern_hash(const char *str)
+{
+	unsigned int h = 2166136261U;
+
+	for (; *str; str++)
+	{
+		h ^= (unsigned char)*str;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Get the interned copy of <str>, which must be released with
+ * str_release() and may not be modified. NULL gives NULL.
+ */
+char *str_intern(const char *str)
+{
+	struct istring	*is;
+	unsigned int	key;
+	size_t		len;
+
+	if (!str) return NULL;
+
+	if (!intern_table)
+	{
+		intern_table = hash_new(intern_cmp);
+		if (!intern_table)
+		{
+			log_err(intern, "Not enough memory left to create the string table!?\n");
+			exit(-1);
+		}
+	}
+
+	key = intern_hash(str);
+	is = hash_find(intern_table, key, str);
+	if (is)
+	{
+		is->refs++;
+		return is->str;
+	}
+
+	len = strlen(str);
+	is = malloc(sizeof(*is) + len);
+	if (!is)
+	{
+		log_err(intern, "Not enough memory left to intern a string!?\n");
+		exit(-1);
+	}
+	is->refs = 1;
+	is->key = key;
+	memcpy(is->str, str, len+1);
+
+	hash_add(intern_table, key, is);
+	return is->str;
+}
+
+/* Drop a reference to an interned string, NULL is ignored */
+void str_release(char *str)
+{
+	struct istring *is;
+
+	if (!str) return;
+
+	is = istring_of(str);
+	if (--is->refs > 0) return;
+
+	hash_delete(intern_table, is->key, is);
+	free(is);
+}
+
+/* Number of distinct interned strings */
+unsigned int str_interned()
+{
+	return intern_table ? hashcount(intern_table) : 0;
+}
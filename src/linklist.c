@@ -4,6 +4,7 @@
  */
 
 #include "linklist.h"
+#include "pool.h"
 #include <string.h>
 #include <strings.h>
 #include <stdlib.h>
@@ -25,21 +26,19 @@ void list_free(struct list *l)
 	if (l) free(l);
 }
 
+/* Where the listnodes come from */
+static struct pool listnode_pool = POOL_INIT("listnode", struct listnode);
+
 /* Allocate new listnode.  Internal use only. */
 static struct listnode *listnode_new()
 {
-	struct listnode *node;
-
-	node = malloc(sizeof(struct listnode));
-	if (!node) return NULL;
-	memset(node, 0, sizeof(struct listnode));
-	return node;
+	return pool_alloc(&listnode_pool);
 }
 
 /* Free listnode. */
 static void listnode_free(struct listnode *node)
 {
-	free(node);
+	pool_free(&listnode_pool, node);
 }
 
 /* Add new data to the list. */
@@ -104,3 +103,33 @@ void list_delete(struct list *list)
 	list_delete_all_node(list);
 	list_free(list);
 }
+
+/* Initialize an empty intrusive list. */
+void dlist_init(struct dlist *list)
+{
+	memset(list, 0, sizeof(struct dlist));
+}
+
+/* Link node, embedded in val, at the end of the list. */
+void dlist_add(struct dlist *list, struct dlistnode *node, void *val)
+{
+	node->next = NULL;
+	node->prev = list->tail;
+	node->data = val;
+
+	if (list->head == NULL) list->head = node;
+	else list->tail->next = node;
+	list->tail = node;
+	list->count++;
+}
+
+/* Unlink node from the list, the node must be on it. */
+void dlist_unlink(struct dlist *list, struct dlistnode *node)
+{
+	if (node->prev) node->prev->next = node->next;
+	else list->head = node->next;
+	if (node->next) node->next->prev = node->prev;
+	else list->tail = node->prev;
+	list->count--;
+	node->prev = node->next = node->data = NULL;
+}
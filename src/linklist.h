@@ -22,6 +22,25 @@ struct list
 	void		(*del)(void *val);
 };
 
+/*
+ * Intrusive list, the node is embedded in the structure
+ * it links in, thus removing it doesn't require a search
+ * and adding it doesn't require an allocation.
+ */
+struct dlistnode
+{
+	struct dlistnode	*next;
+	struct dlistnode	*prev;
+	void			*data;	/* The structure this node is embedded in */
+};
+
+struct dlist
+{
+	struct dlistnode	*head;
+	struct dlistnode	*tail;
+	int			count;
+};
+
 #define nextnode(X)	((X) = (X)->next)
 #define listhead(X)	((X)->head)
 #define listcount(X)	((X)->count)
@@ -35,6 +54,9 @@ void		listnode_add(struct list *, void *);
 void		listnode_delete(struct list *, void *);
 void		list_delete(struct list *);
 void		list_delete_all_node(struct list *);
+void		dlist_init(struct dlist *);
+void		dlist_add(struct dlist *, struct dlistnode *, void *);
+void		dlist_unlink(struct dlist *, struct dlistnode *);
 
 /* List iteration macro. */
 #define LIST_LOOP(L,V,N) \
@@ -51,5 +73,10 @@ void		list_delete_all_node(struct list *);
 
 #define LIST_LOOP2_END }
 
+/* Intrusive list iteration macros, the same as above */
+#define DLIST_LOOP(L,V,N)	LIST_LOOP(L,V,N)
+#define DLIST_LOOP2(L,V,N,M)	LIST_LOOP2(L,V,N,M)
+#define DLIST_LOOP2_END		LIST_LOOP2_END
+
 #endif /* __LINKLIST_H */
 
@@ -0,0 +1,323 @@
+/******************************************************
+ Talamasca
+ by Jeroen Massar <jeroen@unfix.org>
+ (C) Copyright Jeroen Massar 2004 All Rights Reserved
+ http://unfix.org/projects/talamasca/
+*******************************************************
+ $Author: $
+ $Id: $
+ $Date: $
+*******************************************************
+ Asynchronous logging
+
+ Writing to syslog or the terminal can block, which
+ would stall relaying, especially with -v where every
+ line sent and received gets logged. Log lines are thus
+ formatted into a ring buffer and written out by a
+ logger thread. Any thread can add to the ring without
+ taking a lock, the logger thread is the only one taking
+ lines out. When the ring is full the line is dropped
+ and counted, the logger reports the drops later on.
+ Before log_init() and after log_exit() lines are
+ written out directly.
+******************************************************/
+
+#include "talamasca.h"
+#include <pthread.h>
+
+#define LOG_RING	4096		/* Slots in the ring, a power of 2 */
+#define LOG_LINE	512		/* Longest line, longer ones are cut */
+#define LOG_LEVELS	(LOG_DEBUG+1)	/* Syslog levels, for the drop counters */
+
+/* A slot in the ring */
+struct logslot
+{
+	unsigned int	seq;		/* Position this slot is for, see log_put() */
+	int		level;		/* Syslog level */
+	const char	*module;	/* Module, always a literal */
+	char		line[LOG_LINE];	/* The formatted line */
+};
+
+/*
+ * A slot is free for position <pos> when seq == pos, and filled
+ * for it when seq == pos + 1. After the logger emptied it it gets
+ * pos + LOG_RING, which is the next round through the ring.
+ */
+static struct logslot	log_ring[LOG_RING];
+static unsigned int	log_head = 0;			/* Next position to fill (producers) */
+static unsigned int	log_tail = 0;			/* Next position to write out (logger) */
+static uint64_t		log_drops[LOG_LEVELS];		/* Lines dropped per level */
+
+/* The logger thread, sleeps on the condition when the ring is empty */
+static pthread_t	log_thread_id;
+static pthread_mutex_t	log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	log_cond = PTHREAD_COND_INITIALIZER;
+static bool		log_running = false;
+static bool		log_quit = false;
+static int		log_sleeping = 0;
+
+/* Names of the categories, as used by set log_categories */
+static const char *log_category_names[LOGC_MAX] =
+{
+	[LOGC_core]	= "core",
+	[LOGC_common]	= "common",
+	[LOGC_event]	= "event",
+	[LOGC_resolve]	= "resolve",
+	[LOGC_intern]	= "intern",
+	[LOGC_log]	= "log",
+	[LOGC_parse]	= "parse",
+	[LOGC_server]	= "server",
+	[LOGC_privmsg]	= "privmsg",
+	[LOGC_channel]	= "channel",
+	[LOGC_user]	= "user",
+	[LOGC_config]	= "config",
+};
+
+static const char *log_levelname(int level)
+{
+	return	level == LOG_DEBUG ?	"debug" :
+		(level == LOG_ERR ?	"error" :
+		(level == LOG_WARNING ?	"warn" :
+		(level == LOG_INFO ?	"info" : "")));
+}
+
+/* Write a formatted line out */
+static void log_output(int level, const char *module, const char *line)
+{
+	if (g_conf && g_conf->daemonize) syslog(LOG_LOCAL7|level, "%s", line);
+	else
+	{
+		if (g_conf && g_conf->verbose) printf("[%6s : %7s] ", log_levelname(level), module);
+		else if (level == LOG_ERR) printf("Error: ");
+		fputs(line, stdout);
+	}
+}
+
+/* Claim a slot, fill it and hand it to the logger, false when the ring is full */
+static bool log_put(int level, const char *module, const char *fmt, va_list ap)
+{
+	struct logslot	*slot;
+	unsigned int	pos, seq;
+	int		len;
+
+	pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		slot = &log_ring[pos & (LOG_RING-1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		/* Free for us? -> try to claim it */
+		if (seq == pos)
+		{
+			if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, true,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		}
+		/* Still holding the line of the previous round -> full */
+		else if ((int)(seq - pos) < 0) return false;
+		/* Somebody else claimed it first, try the next one */
+		else pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	}
+
+	slot->level = level;
+	slot->module = module;
+	len = vsnprintf(slot->line, sizeof(slot->line), fmt, ap);
+
+	/* Cut lines still end in a newline */
+	if (len >= (int)sizeof(slot->line)) slot->line[sizeof(slot->line)-2] = '\n';
+
+	/* Publish it */
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* The logger thread */
+static void *log_thread(void *arg)
+{
+	struct logslot	*slot;
+	struct timespec	ts;
+	uint64_t	reported = 0, drops;
+	unsigned int	i;
+	char		buf[128];
+
+	for (;;)
+	{
+		slot = &log_ring[log_tail & (LOG_RING-1)];
+
+		/* A line waiting? -> write it out and free the slot */
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == log_tail + 1)
+		{
+			log_output(slot->level, slot->module, slot->line);
+			__atomic_store_n(&slot->seq, log_tail + LOG_RING, __ATOMIC_RELEASE);
+			log_tail++;
+			continue;
+		}
+
+		/* Caught up, tell about what got lost meanwhile */
+		for (drops = 0, i = 0; i < LOG_LEVELS; i++) drops += __atomic_load_n(&log_drops[i], __ATOMIC_RELAXED);
+		if (drops != reported)
+		{
+			snprintf(buf, sizeof(buf), "Log buffer overflowed, dropped %" PRIu64 " lines\n", drops - reported);
+			log_output(LOG_WARNING, "log", buf);
+			reported = drops;
+		}
+		fflush(stdout);
+
+		/*
+		 * Go to sleep, unless a line came in just now. Producers
+		 * only signal while we sleep, the timeout catches a
+		 * signal that got lost in between anyway.
+		 */
+		pthread_mutex_lock(&log_lock);
+		__atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+		if (	!log_quit &&
+			__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != log_tail + 1)
+		{
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 100 * 1000 * 1000;
+			if (ts.tv_nsec >= 1000 * 1000 * 1000)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000 * 1000 * 1000;
+			}
+			pthread_cond_timedwait(&log_cond, &log_lock, &ts);
+		}
+		__atomic_store_n(&log_sleeping, 0, __ATOMIC_SEQ_CST);
+
+		/* Only stop once everything has been written out */
+		if (log_quit && __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_tail + 1)
+		{
+			pthread_mutex_unlock(&log_lock);
+			break;
+		}
+		pthread_mutex_unlock(&log_lock);
+	}
+
+	fflush(stdout);
+	return NULL;
+}
+
+void dologA(int level, char *module, const char *fmt, va_list ap)
+{
+	/* The log_*() macros check the category as well */
+	if (level > LOG_MAXLEVEL || (level == LOG_DEBUG && g_conf && !g_conf->verbose)) return;
+
+	/* No logger thread (yet)? -> write it out directly */
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+	{
+		char line[LOG_LINE];
+
+		vsnprintf(line, sizeof(line), fmt, ap);
+		log_output(level, module, line);
+		return;
+	}
+
+	if (!log_put(level, module, fmt, ap))
+	{
+		__atomic_fetch_add(&log_drops[level & LOG_PRIMASK], 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	/* Wake up the logger when it is sleeping */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&log_sleeping, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&log_lock);
+		pthread_cond_signal(&log_cond);
+		pthread_mutex_unlock(&log_lock);
+	}
+}
+
+/* Use the log_*() macros, they skip the formatting of lines that are filtered anyway */
+void log_printf(int level, char *module, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	dologA(level, module, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Limit the debug output to the categories in <list>, separated
+ * by commas, or "all". Nothing changes when a name is unknown.
+ */
+bool log_set_categories(const char *list)
+{
+	const char	*c = list, *e;
+	unsigned int	mask = 0, i, len;
+
+	if (strcasecmp(list, "all") == 0)
+	{
+		g_conf->log_categories = LOGC_ALL;
+		return true;
+	}
+
+	while (*c)
+	{
+		e = strchr(c, ',');
+		len = e ? (unsigned int)(e - c) : strlen(c);
+
+		for (i = 0; i < LOGC_MAX; i++)
+		{
+			if (	strlen(log_category_names[i]) == len &&
+				strncasecmp(log_category_names[i], c, len) == 0) break;
+		}
+		if (i == LOGC_MAX)
+		{
+			log_err(log, "Unknown log category %.*s\n", len, c);
+			return false;
+		}
+		mask |= 1 << i;
+
+		c += len;
+		if (*c == ',') c++;
+	}
+
+	g_conf->log_categories = mask;
+	return true;
+}
+
+/* Lines of <level> dropped as the ring was full */
+uint64_t log_dropped(int level)
+{
+	return __atomic_load_n(&log_drops[level & LOG_PRIMASK], __ATOMIC_RELAXED);
+}
+
+/* Write out the ring and stop the logger, also called on exit() */
+void log_exit()
+{
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) return;
+
+	pthread_mutex_lock(&log_lock);
+	log_quit = true;
+	pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_lock);
+
+	pthread_join(log_thread_id, NULL);
+
+	/* From here on everything is written out directly again */
+	__atomic_store_n(&log_running, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * Start the logger thread, like the resolver
+ * only do this after daemonizing
+ */
+bool log_init()
+{
+	unsigned int i;
+
+	for (i = 0; i < LOG_RING; i++) log_ring[i].seq = i;
+	log_head = log_tail = 0;
+	log_quit = false;
+
+	if (pthread_create(&log_thread_id, NULL, log_thread, NULL) != 0)
+	{
+		log_err(log, "Couldn't start the logger thread\n");
+		return false;
+	}
+	__atomic_store_n(&log_running, true, __ATOMIC_RELEASE);
+
+	/* Don't lose what is still in the ring when something calls exit() */
+	atexit(log_exit);
+	return true;
+}
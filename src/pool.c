@@ -0,0 +1,116 @@
+/* Fixed size object pools.
+ * by Jeroen Massar for talamasca
+ */
+
+#include "pool.h"
+#include <string.h>
+#include <stdlib.h>
+
+/* Bytes per slab, a slab holds at least POOL_MINOBJS objects */
+#define POOL_SLABSIZE	16384
+#define POOL_MINOBJS	8
+
+/* Alignment of the objects */
+#define POOL_ALIGN(X)	(((X) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1))
+
+struct pool_slab
+{
+	struct pool_slab	*next;
+};
+
+struct pool *pool_list = NULL;
+
+/* Carve a new slab into free objects. */
+static int pool_grow(struct pool *pool)
+{
+	struct pool_slab	*slab;
+	char			*obj;
+	unsigned int		i;
+
+	/* First use? */
+	if (pool->perslab == 0)
+	{
+		/* The free list is kept inside the released objects */
+		if (pool->size < sizeof(void *)) pool->size = sizeof(void *);
+		pool->size = POOL_ALIGN(pool->size);
+
+		pool->perslab = POOL_SLABSIZE / pool->size;
+		if (pool->perslab < POOL_MINOBJS) pool->perslab = POOL_MINOBJS;
+
+		pool->next = pool_list;
+		pool_list = pool;
+	}
+
+	slab = malloc(POOL_ALIGN(sizeof(struct pool_slab)) + pool->perslab * pool->size);
+	if (!slab) return 0;
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	pool->numslabs++;
+
+	/* Put the objects on the free list, the first one on top */
+	obj = (char *)slab + POOL_ALIGN(sizeof(struct pool_slab)) + pool->perslab * pool->size;
+	for (i = 0; i < pool->perslab; i++)
+	{
+		obj -= pool->size;
+		*(void **)obj = pool->freelist;
+		pool->freelist = obj;
+	}
+
+	return 1;
+}
+
+/* Get a cleared object from the pool. */
+void *pool_alloc(struct pool *pool)
+{
+	void *obj;
+
+	if (!pool->freelist && !pool_grow(pool)) return NULL;
+
+	obj = pool->freelist;
+	pool->freelist = *(void **)obj;
+	memset(obj, 0, pool->size);
+
+	pool->allocs++;
+	pool->inuse++;
+	if (pool->inuse > pool->peak) pool->peak = pool->inuse;
+
+	return obj;
+}
+
+/* Return an object to its pool. */
+void pool_free(struct pool *pool, void *obj)
+{
+	if (!obj) return;
+
+	*(void **)obj = pool->freelist;
+	pool->freelist = obj;
+
+	pool->frees++;
+	pool->inuse--;
+}
+
+/* Release all the slabs, nothing may use any pool afterwards. */
+void pool_exit()
+{
+	struct pool		*pool;
+	struct pool_slab	*slab;
+
+	while (pool_list)
+	{
+		pool = pool_list;
+		pool_list = pool->next;
+
+		while (pool->slabs)
+		{
+			slab = pool->slabs;
+			pool->slabs = slab->next;
+			free(slab);
+		}
+		pool->freelist	= NULL;
+		pool->numslabs	= 0;
+		pool->perslab	= 0;
+		pool->inuse	= 0;
+		pool->next	= NULL;
+	}
+}
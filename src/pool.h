@@ -0,0 +1,49 @@
+/*
+ * Fixed size object pools
+ * Objects are carved out of larger slabs and kept on a
+ * free list when released, slabs are only returned on exit
+ * by Jeroen Massar for talamasca
+ */
+
+#ifndef __POOL_H
+#define __POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct pool
+{
+	const char	*name;		/* Name for the statistics */
+	size_t		size;		/* Size of an object */
+
+	unsigned int	perslab;	/* Objects per slab */
+	void		*slabs;		/* Allocated slabs */
+	void		*freelist;	/* Released objects */
+	struct pool	*next;		/* Next pool in pool_list */
+
+	/* Statistics */
+	unsigned int	numslabs,	/* Number of slabs */
+			inuse,		/* Objects handed out */
+			peak;		/* Most objects handed out at once */
+	uint64_t	allocs,		/* Number of pool_alloc() calls */
+			frees;		/* Number of pool_free() calls */
+};
+
+/* Static initializer, eg: struct pool user_pool = POOL_INIT("user", struct user); */
+#define POOL_INIT(N,T)	{ N, sizeof(T), 0, NULL, NULL, NULL, 0, 0, 0, 0, 0 }
+
+#define poolsize(X)	((X)->numslabs * (X)->perslab)
+
+/* All pools that have been used */
+extern struct pool	*pool_list;
+
+/* Prototypes. */
+void		*pool_alloc(struct pool *);
+void		pool_free(struct pool *, void *);
+void		pool_exit();
+
+/* Pool iteration macro */
+#define POOL_LOOP(P) \
+  for ((P) = pool_list; (P); (P) = (P)->next)
+
+#endif /* __POOL_H */
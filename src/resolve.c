@@ -0,0 +1,340 @@
+/******************************************************
+ Talamasca
+ by Jeroen Massar <jeroen@unfix.org>
+ (C) Copyright Jeroen Massar 2004 All Rights Reserved
+ http://unfix.org/projects/talamasca/
+*******************************************************
+ $Author: $
+ $Id: $
+ $Date: $
+*******************************************************
+ Asynchronous hostname resolving
+
+ getaddrinfo() can block for a long time, thus the
+ lookups are done by a few helper threads. Finished
+ lookups are queued and the helper pokes the event loop
+ through a pipe, the main thread then hands the result
+ to the waiting callbacks. Results are cached for
+ resolve_ttl seconds. As getaddrinfo() is used, entries
+ in /etc/hosts are honored, which is handy for testing.
+******************************************************/
+
+#include "talamasca.h"
+#include <pthread.h>
+
+/* Number of helper threads */
+#define RESOLVE_THREADS 2
+
+/* Somebody waiting for a lookup */
+struct resolve_waiter
+{
+	void			(*callback)(struct addrinfo *res, void *data);
+	void			*data;
+};
+
+/* A cached lookup */
+struct resolve_entry
+{
+	char			*hostname;
+	char			*service;
+	int			family;
+	int			socktype;
+
+	struct addrinfo		*res;		/* The result (NULL = failed) */
+	time_t			expires;	/* When this result becomes stale */
+	bool			pending;	/* Lookup in progress */
+	struct list		*waiters;	/* Waiting callbacks (struct resolve_waiter) */
+};
+
+/* A lookup handed to the helper threads */
+struct resolve_job
+{
+	struct resolve_job	*next;
+	struct resolve_entry	*entry;		/* Only touched by the main thread */
+	char			*hostname;
+	char			*service;
+	struct addrinfo		hints;
+	struct addrinfo		*res;
+	int			error;
+};
+
+/* Shared between the main thread and the helpers, protected by lock */
+static pthread_mutex_t		resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		resolve_cond = PTHREAD_COND_INITIALIZER;
+static struct resolve_job	*resolve_todo = NULL;	/* Jobs for the helpers */
+static struct resolve_job	*resolve_done = NULL;	/* Jobs for the main thread */
+static bool			resolve_quit = false;
+
+/* Main thread only */
+static struct list		*resolve_cache = NULL;	/* struct resolve_entry */
+static int			resolve_pipe[2] = { -1, -1 };
+
+static void resolve_job_free(struct resolve_job *job)
+{
+	if (job->res) freeaddrinfo(job->res);
+	if (job->hostname) free(job->hostname);
+	if (job->service) free(job->service);
+	free(job);
+}
+
+static void resolve_entry_destroy(struct resolve_entry *entry)
+{
+	list_delete(entry->waiters);
+	if (entry->res) freeaddrinfo(entry->res);
+	if (entry->hostname) free(entry->hostname);
+	if (entry->service) free(entry->service);
+	free(entry);
+}
+
+/* The helper threads */
+static void *resolve_thread(void *arg)
+{
+	struct resolve_job	*job, **j;
+	char			c = 0;
+
+	pthread_mutex_lock(&resolve_lock);
+	while (!resolve_quit)
+	{
+		if (!resolve_todo)
+		{
+			pthread_cond_wait(&resolve_cond, &resolve_lock);
+			continue;
+		}
+
+		/* Take the first job */
+		job = resolve_todo;
+		resolve_todo = job->next;
+		pthread_mutex_unlock(&resolve_lock);
+
+		/* This is the part that can take a while */
+		job->error = getaddrinfo(job->hostname, job->service, &job->hints, &job->res);
+		if (job->error != 0) job->res = NULL;
+
+		/* Hand it back to the main thread, in order */
+		pthread_mutex_lock(&resolve_lock);
+		job->next = NULL;
+		for (j = &resolve_done; *j; j = &(*j)->next);
+		*j = job;
+
+		/* Wake up the event loop */
+		write(resolve_pipe[1], &c, 1);
+	}
+	pthread_mutex_unlock(&resolve_lock);
+
+	return NULL;
+}
+
+/* Called from the event loop when lookups finished */
+static void resolve_event(SOCKET sock, unsigned int events, void *data)
+{
+	struct resolve_job	*jobs, *job;
+	struct resolve_entry	*entry;
+	struct resolve_waiter	*w;
+	struct list		*waiters;
+	struct listnode		*ln;
+	char			buf[64];
+
+	/* Drain the pipe */
+	while (read(sock, buf, sizeof(buf)) > 0);
+
+	/* Take all the finished jobs */
+	pthread_mutex_lock(&resolve_lock);
+	jobs = resolve_done;
+	resolve_done = NULL;
+	pthread_mutex_unlock(&resolve_lock);
+
+	while (jobs)
+	{
+		job = jobs;
+		jobs = job->next;
+		entry = job->entry;
+
+		if (job->error != 0)
+		{
+			log_err(resolve, "Couldn't resolve host %s, service %s: %s\n",
+				job->hostname, job->service, gai_strerror(job->error));
+		}
+		else log_debug(resolve, "Resolved %s, service %s\n", job->hostname, job->service);
+
+		/* Store the result, failures are retried on the next request */
+		if (entry->res) freeaddrinfo(entry->res);
+		entry->res	= job->res;
+		entry->expires	= job->res ? time(NULL) + g_conf->resolve_ttl : 0;
+		entry->pending	= false;
+		job->res	= NULL;
+		resolve_job_free(job);
+
+		/*
+		 * Take the waiters off the entry first, the callbacks
+		 * might request new lookups or cancel other ones
+		 */
+		waiters = entry->waiters;
+		entry->waiters = list_new();
+		if (!entry->waiters)
+		{
+			log_err(resolve, "Not enough memory left for the waiter list!?\n");
+			exit(-1);
+		}
+		entry->waiters->del = free;
+
+		LIST_LOOP(waiters, w, ln)
+		{
+			w->callback(entry->res, w->data);
+		}
+		list_delete(waiters);
+	}
+}
+
+bool resolve_init()
+{
+	pthread_t	thread;
+	unsigned int	i;
+
+	resolve_cache = list_new();
+	if (!resolve_cache) return false;
+	resolve_cache->del = (void(*)(void *))resolve_entry_destroy;
+
+	if (pipe(resolve_pipe) != 0)
+	{
+		log_err(resolve, "Couldn't create the resolver pipe: %s (%d)\n", strerror(errno), errno);
+		return false;
+	}
+	fcntl(resolve_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(resolve_pipe[1], F_SETFL, O_NONBLOCK);
+
+	if (!event_add(resolve_pipe[0], EV_READ, resolve_event, NULL)) return false;
+
+	for (i=0; i < RESOLVE_THREADS; i++)
+	{
+		if (pthread_create(&thread, NULL, resolve_thread, NULL) != 0)
+		{
+			log_err(resolve, "Couldn't start resolver thread\n");
+			return false;
+		}
+		/* They die together with the process */
+		pthread_detach(thread);
+	}
+
+	return true;
+}
+
+void resolve_exit()
+{
+	/* Stop the helpers, one might still be stuck in getaddrinfo() */
+	pthread_mutex_lock(&resolve_lock);
+	resolve_quit = true;
+	pthread_cond_broadcast(&resolve_cond);
+	pthread_mutex_unlock(&resolve_lock);
+
+	if (resolve_pipe[0] != -1) event_del(resolve_pipe[0]);
+
+	if (resolve_cache) list_delete(resolve_cache);
+	resolve_cache = NULL;
+}
+
+/*
+ * Resolve <hostname> <service>, <callback> gets called with the
+ * result, or NULL when it failed, when the lookup is done.
+ * Cached results are returned directly from this call.
+ */
+void resolve(const char *hostname, const char *service, int family, int socktype, void (*callback)(struct addrinfo *res, void *data), void *data)
+{
+	struct resolve_entry	*entry;
+	struct resolve_waiter	*w;
+	struct resolve_job	*job, **j;
+	struct listnode		*ln;
+
+	LIST_LOOP(resolve_cache, entry, ln)
+	{
+		if (	entry->family == family &&
+			entry->socktype == socktype &&
+			strcasecmp(entry->hostname, hostname) == 0 &&
+			strcmp(entry->service, service) == 0) break;
+	}
+
+	if (!ln)
+	{
+		entry = malloc(sizeof(*entry));
+		if (!entry)
+		{
+			log_err(resolve, "Not enough memory left to create a cache entry!?\n");
+			exit(-1);
+		}
+		memset(entry, 0, sizeof(*entry));
+		entry->hostname		= strdup(hostname);
+		entry->service		= strdup(service);
+		entry->family		= family;
+		entry->socktype		= socktype;
+		entry->waiters		= list_new();
+		entry->waiters->del	= free;
+		listnode_add(resolve_cache, entry);
+	}
+
+	/* Still fresh? */
+	if (!entry->pending && entry->res && time(NULL) < entry->expires)
+	{
+		log_debug(resolve, "Using cached result for %s, service %s\n", hostname, service);
+		callback(entry->res, data);
+		return;
+	}
+
+	/* Wait for the result */
+	w = malloc(sizeof(*w));
+	if (!w)
+	{
+		log_err(resolve, "Not enough memory left to wait for a lookup!?\n");
+		exit(-1);
+	}
+	w->callback	= callback;
+	w->data		= data;
+	listnode_add(entry->waiters, w);
+
+	/* Already being looked up? */
+	if (entry->pending) return;
+
+	job = malloc(sizeof(*job));
+	if (!job)
+	{
+		log_err(resolve, "Not enough memory left to create a lookup!?\n");
+		exit(-1);
+	}
+	memset(job, 0, sizeof(*job));
+	job->entry		= entry;
+	job->hostname		= strdup(hostname);
+	job->service		= strdup(service);
+	job->hints.ai_family	= family;
+	job->hints.ai_socktype	= socktype;
+
+	entry->pending = true;
+
+	log_debug(resolve, "Looking up %s, service %s\n", hostname, service);
+
+	/* Hand it to the helpers, behind the ones that are already waiting */
+	pthread_mutex_lock(&resolve_lock);
+	job->next = NULL;
+	for (j = &resolve_todo; *j; j = &(*j)->next);
+	*j = job;
+	pthread_cond_signal(&resolve_cond);
+	pthread_mutex_unlock(&resolve_lock);
+}
+
+/* Don't call back for <data> anymore, eg because it is destroyed */
+void resolve_cancel(void *data)
+{
+	struct resolve_entry	*entry;
+	struct resolve_waiter	*w;
+	struct listnode		*ln, *wn, *wn2;
+
+	if (!resolve_cache) return;
+
+	LIST_LOOP(resolve_cache, entry, ln)
+	{
+		LIST_LOOP2(entry->waiters, w, wn, wn2)
+		{
+			if (w->data != data) continue;
+			listnode_delete(entry->waiters, w);
+			free(w);
+		}
+		LIST_LOOP2_END
+	}
+}
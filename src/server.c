@@ -13,21 +13,131 @@
 
 #include "talamasca.h"
 
+/* Glue the pieces of a line together, only needed for logging them */
+static unsigned int server_flatten(const struct iovec *iov, unsigned int iovcnt, struct msgbuf *body, char *buf, unsigned int buflen)
+{
+	unsigned int i, n, len = 0;
+
+	for (i = 0; i < iovcnt && len < buflen - 1; i++)
+	{
+		n = iov[i].iov_len < buflen - 1 - len ? iov[i].iov_len : buflen - 1 - len;
+		memcpy(&buf[len], iov[i].iov_base, n);
+		len += n;
+	}
+	if (body)
+	{
+		n = body->len < buflen - 1 - len ? body->len : buflen - 1 - len;
+		memcpy(&buf[len], body->data, n);
+		len += n;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+/*
+ * Queue a line that is given in pieces, eg a body that is shared
+ * by several recipients with only the target spliced in front of it
+ * The pieces are copied, the optional <body> ends the line and is
+ * only referenced
+ */
+void server_sendv(struct server *server, const struct iovec *iov, unsigned int iovcnt, struct msgbuf *body)
+{
+	char		buf[BUFFERSIZE];
+	unsigned int	i, n, len = 0;
+	bool		empty;
+
+	/* When not connected (yet) send it to the logs */
+	if (server->socket == -1 || server->state == SS_CONNECTING)
+	{
+		server_flatten(iov, iovcnt, body, buf, sizeof(buf));
+		log_info(server, "%s", buf);
+		return;
+	}
+
+	for (i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+	if (body) len += body->len;
+
+	/* Show this as debug output? */
+	if (g_conf->verbose && len > 0)
+	{
+		n = server_flatten(iov, iovcnt, body, buf, sizeof(buf));
+		log_debug(server, "server_printf (%03x) : \"%.*s\"\n",
+			server->socket, buf[n-1] == '\n' ? n-1 : n, buf);
+	}
+
+	/* Nicks still being packed into a SJOIN join before anything else happens */
+	if (server->sjoin.channel) channel_sjoin_flush(server);
+
+	/* Don't let a stuck link eat all our memory */
+	if (server->sendq_exceeded) return;
+	if (sendq_depth(&server->sendq) + len > SENDQ_MAX)
+	{
+		log_err(server, "[%s@%s:%s] SendQ exceeded (%u bytes), dropping link\n",
+			server->name, server->hostname, server->port, sendq_depth(&server->sendq));
+		server->sendq_exceeded = true;
+		return;
+	}
+
+	empty = sendq_depth(&server->sendq) == 0;
+	for (i = 0; i < iovcnt; i++)
+	{
+		if (!sendq_append(&server->sendq, iov[i].iov_base, iov[i].iov_len)) return;
+	}
+	if (body && !sendq_append_msg(&server->sendq, body)) return;
+
+	server->stat_sent_msg++;
+
+	/*
+	 * Nothing was waiting, send it before the event loop sleeps again.
+	 * Everything else printed till then gets sent along in one go.
+	 */
+	if (empty) event_defer(server->socket);
+}
+
 void server_printf(struct server *server, const char *fmt, ...)
 {
-	int i;
-	va_list ap;
+	char		buf[BUFFERSIZE];
+	struct iovec	iov;
+	unsigned int	len;
+	va_list		ap;
 
+	/* Format the string */
 	va_start(ap, fmt);
-	i = sock_printfA(server->socket, fmt, ap);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
-	
-	/* Update statistics */
-	if (i > 0)
+	if (len >= sizeof(buf)) len = sizeof(buf)-1;
+
+	/* server_sendv() logs it when not connected (yet) */
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	server_sendv(server, &iov, 1, NULL);
+}
+
+/* Send what is in the sendq, the rest waits till the socket becomes writable */
+void server_write(struct server *server)
+{
+	int i;
+
+	if (server->socket == -1 || server->state == SS_CONNECTING) return;
+
+	/* The last SJOIN that was being packed goes along, a burst fills it up first */
+	if (!server->burst.active) channel_sjoin_flush(server);
+
+	i = sendq_flush(server->socket, &server->sendq);
+	if (i < 0)
 	{
-		server->stat_sent_msg++;
-		server->stat_sent_bytes+=i;
+		log_debug(server, "[%s@%s:%s] Send failed: %s (%d)\n",
+			server->name, server->hostname, server->port, strerror(errno), errno);
+		/* The reader will notice the broken socket and disconnect */
+		event_modify(server->socket, EV_READ);
+		return;
 	}
+
+	/* Update statistics */
+	server->stat_sent_bytes += i;
+
+	/* Only wait for writability while there is something to write */
+	event_modify(server->socket, sendq_depth(&server->sendq) > 0 ? EV_READ|EV_WRITE : EV_READ);
 }
 
 struct server *server_find_tag(char *tag)
@@ -42,62 +152,68 @@ struct server *server_find_tag(char *tag)
 	return NULL;
 }
 
+/* Where the serverusers come from */
+static struct pool serveruser_pool = POOL_INIT("serveruser", struct serveruser);
+
+/* Take the serveruser off the server and free it */
+static void serveruser_destroy(struct serveruser *su)
+{
+	ptrhash_delete(&su->server->members, su->user);
+	dlist_unlink(&su->server->users, &su->node);
+	pool_free(&serveruser_pool, su);
+}
+
+/* Stop introducing our users and channels to <server>, see server_burst() */
+static void server_burst_stop(struct server *server)
+{
+	if (!server->burst.active) return;
+	server->burst.active = false;
+	g_conf->bursting--;
+}
+
 struct serveruser *server_find_user(struct server *server, struct user *user)
 {
-	struct serveruser	*su;
-	struct listnode		*ln;
-	
 	if (!server)
 	{
-		dolog(LOG_ERR, "server", "server_find_user() - Something passed me a NULL server!\n");
+		log_err(server, "server_find_user() - Something passed me a NULL server!\n");
 		return NULL;
 	}
 	if (!user)
 	{
-		dolog(LOG_ERR, "server", "server_find_user() - Something passed me a NULL user!\n");
+		log_err(server, "server_find_user() - Something passed me a NULL user!\n");
 		return NULL;
 	}
 
-	LIST_LOOP(server->users, su, ln)
-	{
-		if (su->user == user) return su;
-	}
-	return NULL;
+	return ptrhash_find(&server->members, user);
 }
 
 struct channel *server_find_channel(struct server *server, char *channel)
 {
-	struct channel	*ch;
-	struct listnode	*cn;
+	char foldname[1024];
 
-	LIST_LOOP(server->channels, ch, cn)
-	{
-		if (strcasecmp(channel, ch->name) == 0) return ch;
-	}
-	return NULL;
+	casemap_fold(server->casemapping, channel, foldname, sizeof(foldname));
+	return hash_find(server->channelnames, casemap_hash(foldname), foldname);
 }
 
 struct serveruser *server_find_nick(struct server *server, char *nick)
 {
-	struct serveruser	*su;
-	struct listnode		*ln;
+	struct user		*u;
 	
 	if (!server)
 	{
-		dolog(LOG_ERR, "server", "server_find_nick() - Something passed me a NULL server!\n");
+		log_err(server, "server_find_nick() - Something passed me a NULL server!\n");
 		return NULL;
 	}
 	if (!nick)
 	{
-		dolog(LOG_ERR, "server", "server_find_nick() - Something passed me a NULL nick!\n");
+		log_err(server, "server_find_nick() - Something passed me a NULL nick!\n");
 		return NULL;
 	}
 
-	LIST_LOOP(server->users, su, ln)
-	{
-		if (strcasecmp(su->user->nick, nick) == 0) return su;
-	}
-	return NULL;
+	/* Nicks are globally unique, thus use the global index */
+	u = user_find_nick(server, nick);
+	if (!u) return NULL;
+	return server_find_user(server, u);
 }
 
 struct server *server_add(char *tag, enum srv_types type, char *hostname, char *port, char *nickname, char *name, char *password, char *identity, char *description)
@@ -106,24 +222,27 @@ struct server *server_add(char *tag, enum srv_types type, char *hostname, char *
 
 	if (!server)
 	{
-		dolog(LOG_ERR, "server", "Not enough memory left to create a new server!?\n");
+		log_err(server, "Not enough memory left to create a new server!?\n");
 		exit(-1);
 	}
 
-	dolog(LOG_DEBUG, "server", "server_add(%s:%s)\n", hostname, port);
+	log_debug(server, "server_add(%s:%s)\n", hostname, port);
 
 	/* Initialize */
 	memset(server, 0, sizeof(*server));
 	server->type		= type;
 	server->socket		= -1;
+	server->casemapping	= CASEMAP_RFC1459;
+	server->maxtargets	= 1;
 
 	/* A server has users, who are globally unique, enforced through the global userlist */
-	server->users		= list_new();
-	server->users->del 	= NULL;
+	dlist_init(&server->users);
+	ptrhash_init(&server->members);
 
 	/* A server has channels, not globally unique, but per server */
 	server->channels	= list_new();
 	server->channels->del 	= (void(*)(void *))channel_destroy;
+	server->channelnames	= hash_new(channel_cmp_name);
 
 	if (tag)		server->tag		= strdup(tag);
 	if (hostname)		server->hostname	= strdup(hostname);
@@ -131,8 +250,8 @@ struct server *server_add(char *tag, enum srv_types type, char *hostname, char *
 	if (nickname)		server->nickname	= strdup(nickname);
 	if (name)		server->name		= strdup(name);
 	if (password)		server->password	= strdup(password);
-	if (identity)		server->identity	= strdup(identity);
-	if (description)	server->description	= strdup(description);
+	server->identity	= str_intern(identity);
+	server->description	= str_intern(description);
 
 	/* Add it */
 	listnode_add(g_conf->servers, server);
@@ -143,16 +262,18 @@ struct server *server_add(char *tag, enum srv_types type, char *hostname, char *
 
 void server_destroy(struct server *server)
 {
-	struct server	*srv;
-	struct listnode	*ln;
+	struct server		*srv;
+	struct serveruser	*su;
+	struct listnode		*ln;
+	struct dlistnode	*dn, *dn2;
 
 	if (!server)
 	{
-		dolog(LOG_DEBUG, "server", "server_disconnect() - Something passed me an empty server!\n");
+		log_debug(server, "server_disconnect() - Something passed me an empty server!\n");
 		return;
 	}
 	
-	dolog(LOG_DEBUG, "server", "Destroying server %s:%s\n",
+	log_debug(server, "Destroying server %s:%s\n",
 		server->hostname, server->port);
 
 	/* Cleanup */
@@ -168,14 +289,20 @@ void server_destroy(struct server *server)
 			srv->defaultchannel->server != server) continue;
 
 		/* Deconfigure */
-		dolog(LOG_WARNING, "server", "Deconfiguring %s:%s's default channel %s\n",
+		log_warn(server, "Deconfiguring %s:%s's default channel %s\n",
 			srv->hostname, srv->port, srv->defaultchannel->name);
 		srv->defaultchannel = NULL;
 	}
 
 	/* Free the node */
-	list_delete(server->users);
+	DLIST_LOOP2(&server->users, su, dn, dn2)
+	{
+		serveruser_destroy(su);
+	}
+	DLIST_LOOP2_END
+	ptrhash_clear(&server->members);
 	list_delete(server->channels);
+	hash_free(server->channelnames);
 
 	if (server->tag)			free(server->tag);
 	if (server->hostname)			free(server->hostname);
@@ -183,41 +310,20 @@ void server_destroy(struct server *server)
 	if (server->nickname)			free(server->nickname);
 	if (server->name)			free(server->name);
 	if (server->password)			free(server->password);
-	if (server->identity)			free(server->identity);
-	if (server->description)		free(server->description);
+	str_release(server->identity);
+	str_release(server->description);
 	if (server->bitlbee_identifypass)	free(server->bitlbee_identifypass);
 
 	free(server);
 }
 
-void server_connect(struct server *server)
+/* Send our login information, the connect succeeded */
+void server_login(struct server *server)
 {
-	/* Only (re)connect when not connected
-	 * or when the last time we tried was >(15) seconds ago
-	 */
-	if (	server->socket != -1 ||
-		time(NULL) < server->lastconnect+(15))
-	{
-		dolog(LOG_DEBUG, "server", "Not reconnecting to %s:%s, last connect %u seconds ago\n",
-			server->hostname, server->port, time(NULL)-server->lastconnect);
-		return;
-	}
-
-	dolog(LOG_DEBUG, "server", "Trying to connect to %s:%s\n", server->hostname, server->port);
-
-	/* Try to connect to the server */
-	server->lastconnect = time(NULL);
-	server->socket = connect_client(server->hostname, server->port, AF_UNSPEC, SOCK_STREAM);
-
-	/* Failed? */
-	if (server->socket == -1) return;
-
-	/* We want to read this stuff */
-	FD_SET(server->socket, &g_conf->selectset);
-	if (server->socket > g_conf->hifd) g_conf->hifd = server->socket;
-	g_conf->numsocks++;
+	/* State is authenticating */
+	server->state = SS_AUTHENTICATING;
+	log_debug(server, "%s:%s is now in state: authenticating\n", server->hostname, server->port);
 
-	/* Send our login information */
 	if (server->password)
 	{
 		server_printf(server, "PASS %s%s\n",
@@ -243,13 +349,130 @@ void server_connect(struct server *server)
 		/* Introduce the user to the various servers */
 		user_introduce(server->user);
 	}
+}
 
-	/* State is authenticating */
-	server->state = SS_AUTHENTICATING;
-	dolog(LOG_DEBUG, "server", "%s:%s is now in state: authenticating\n", server->hostname, server->port);
+void server_connect(struct server *server)
+{
+	/* Only (re)connect when not connected
+	 * or when the last time we tried was >(15) seconds ago
+	 */
+	if (	server->socket != -1 ||
+		time(NULL) < server->lastconnect+(15))
+	{
+		log_debug(server, "Not reconnecting to %s:%s, last connect %u seconds ago\n",
+			server->hostname, server->port, time(NULL)-server->lastconnect);
+		return;
+	}
+
+	/* Still waiting for the resolver? */
+	if (server->state == SS_RESOLVING) return;
+
+	log_debug(server, "Trying to connect to %s:%s\n", server->hostname, server->port);
+
+	/* Look up the server, server_resolved() continues from there */
+	server->lastconnect = time(NULL);
+	server->state = SS_RESOLVING;
+	resolve(server->hostname, server->port, AF_UNSPEC, SOCK_STREAM, server_resolved, server);
+}
+
+/* Forget the addresses of the current connect */
+static void server_connect_done(struct server *server)
+{
+	if (server->addrs) free(server->addrs);
+	server->addrs = NULL;
+	server->numaddrs = server->nextaddr = 0;
+}
+
+/*
+ * Start connecting to the next address of the server,
+ * gives up when none is left, server_connect() retries later
+ */
+static void server_connect_next(struct server *server)
+{
+	struct connaddr *a;
+
+	while (server->nextaddr < server->numaddrs)
+	{
+		a = &server->addrs[server->nextaddr++];
+
+		server->socket = connect_client(a->addr.ss_family, (struct sockaddr *)&a->addr, a->addrlen);
+		if (server->socket == -1) continue;
+
+		/* The socket becomes writable when the connect finishes */
+		if (!event_add(server->socket, EV_WRITE, server_event, server))
+		{
+			closesocket(server->socket);
+			server->socket = -1;
+			continue;
+		}
+
+		/* The login gets sent once we are connected, see server_event() */
+		server->state = SS_CONNECTING;
+		server->lastconnect = time(NULL);
+		log_debug(server, "%s:%s is now in state: connecting (address %u of %u)\n",
+			server->hostname, server->port, server->nextaddr, server->numaddrs);
+		return;
+	}
+
+	log_err(server, "Couldn't connect to %s:%s\n", server->hostname, server->port);
+	server_connect_done(server);
+	server->lastconnect = time(NULL);
+	server->state = SS_DISCONNECTED;
+}
+
+/* The connect to the current address failed or timed out, try the next one */
+void server_connect_failed(struct server *server)
+{
+	if (server->state != SS_CONNECTING) return;
+
+	event_del(server->socket);
+	closesocket(server->socket);
+	server->socket = -1;
+	server->state = SS_DISCONNECTED;
+
+	server_connect_next(server);
+}
+
+/* The resolver found the addresses of our server */
+void server_resolved(struct addrinfo *res, void *data)
+{
+	struct server	*server = (struct server *)data;
+	struct addrinfo	*r;
+	unsigned int	n = 0;
+
+	/* Not interested anymore? */
+	if (server->state != SS_RESOLVING) return;
+	server->state = SS_DISCONNECTED;
+
+	/* Failed? Retry later */
+	if (!res) return;
+
+	/*
+	 * Keep a copy of the addresses, the ones after the
+	 * first get tried when connecting to it fails
+	 */
+	for (r = res; r; r = r->ai_next) n++;
+	server_connect_done(server);
+	server->addrs = malloc(n * sizeof(*server->addrs));
+	if (!server->addrs)
+	{
+		log_err(server, "Not enough memory left for the addresses of %s:%s!?\n",
+			server->hostname, server->port);
+		exit(-1);
+	}
+	for (r = res; r; r = r->ai_next)
+	{
+		if (r->ai_addrlen > sizeof(server->addrs[0].addr)) continue;
+		memcpy(&server->addrs[server->numaddrs].addr, r->ai_addr, r->ai_addrlen);
+		server->addrs[server->numaddrs].addrlen = r->ai_addrlen;
+		server->numaddrs++;
+	}
+
+	/* Try to connect to the server */
+	server_connect_next(server);
 }
 
-char *getfreenick(char *tmp, unsigned int len)
+char *getfreenick(struct server *server, char *tmp, unsigned int len)
 {
 	struct user *u = NULL;
 
@@ -257,13 +480,13 @@ char *getfreenick(char *tmp, unsigned int len)
 	do
 	{
 		snprintf(tmp, len, "Ta%ula\n", i); 
-		u = user_find_nick(tmp);
+		u = user_find_nick(server, tmp);
 		i++;
 	}
 	while (u && i <= 9999);
 	if (i <= 9999) return tmp;
 	
-	dolog(LOG_ERR, "server", "Couldn't create a free nickname...\n");
+	log_err(server, "Couldn't create a free nickname...\n");
 	return NULL;
 }
 
@@ -290,7 +513,7 @@ struct serveruser *server_introduce(struct server *server, struct user *user)
 	
 	if (su && su->introduced)
 	{
-		dolog(LOG_DEBUG, "server", "User %s!%s@%s already introduced to server %s:%s\n",
+		log_debug(server, "User %s!%s@%s already introduced to server %s:%s\n",
 			user->nick, user->ident, user->host,
 			server->hostname, server->port);
 		return su;
@@ -299,23 +522,23 @@ struct serveruser *server_introduce(struct server *server, struct user *user)
 	/* Not added yet? */
 	if (!su)
 	{
-		su = malloc(sizeof(*su));
+		su = pool_alloc(&serveruser_pool);
 		if (!su)
 		{
-			dolog(LOG_ERR, "server", "server_introduce() Couldn't allocate memory for serveruser\n");
+			log_err(server, "server_introduce() Couldn't allocate memory for serveruser\n");
 			exit(-42);
 		}
-		memset(su, 0, sizeof(*su));
 		su->server = server;
 		su->user = user;
 
 		/* Add the user to the server list */
-		listnode_add(server->users, su);
+		dlist_add(&server->users, &su->node, su);
+		ptrhash_add(&server->members, user, su);
 	}
 
 	if (server->state != SS_CONNECTED)
 	{
-		dolog(LOG_DEBUG, "server", "Server %s:%s is not connected, thus cannot introduce user %s\n",
+		log_debug(server, "Server %s:%s is not connected, thus cannot introduce user %s\n",
 			server->hostname, server->port, user->nick);
 		return su;
 	}
@@ -333,7 +556,7 @@ struct serveruser *server_introduce(struct server *server, struct user *user)
 	if (	server == user->server ||
 		user == user->server->user)
 	{
-		dolog(LOG_DEBUG, "server", "Not introducing user %s to it's own server\n", user->nick);
+		log_debug(server, "Not introducing user %s to it's own server\n", user->nick);
 		return su;
 	}
 
@@ -351,7 +574,7 @@ struct serveruser *server_introduce(struct server *server, struct user *user)
 	}
 	else if (server->type == SRV_P10)
 	{
-		dolog(LOG_DEBUG, "server", "P10 is not implemented\n");
+		log_debug(server, "P10 is not implemented\n");
 		exit(-42);
 	}
 
@@ -361,15 +584,15 @@ struct serveruser *server_introduce(struct server *server, struct user *user)
 void server_leave(struct server *server, struct user *user, char *reason, bool kill)
 {
 	struct serveruser	*su;
-	struct channel		*ch;
-	struct listnode		*ln;
+	struct channeluser	*cu, *lcu;
+	struct dlistnode	*dn, *dn2;
 
 	/* Try to find the user on the server */
 	su = server_find_user(server, user);
 
 	if (!su)
 	{
-		dolog(LOG_DEBUG, "server", "User %s!%s@%s was not on server %s:%s\n",
+		log_debug(server, "User %s!%s@%s was not on server %s:%s\n",
 			user->nick, user->ident, user->host,
 			server->hostname, server->port);
 		return;
@@ -410,125 +633,280 @@ void server_leave(struct server *server, struct user *user, char *reason, bool k
 	}
 
 	/* Remove the user from the channels she is on */
-	while (user->channels->count > 0)
+	DLIST_LOOP2(&user->channels, cu, dn, dn2)
 	{
-		ch = NULL;
-		LIST_LOOP(user->channels, ch, ln)
-		{
-			/* Only remove the user from channels on this server */
-			if (ch->server != server) continue;
+		/* Only remove the user from channels on this server */
+		if (cu->channel->server != server) continue;
 
-			/* Remove the user from the channel */
-			channel_deluser(ch, user, reason, !kill);
-			/* Start checking at the beginning as the list changed */
-			break;
-		}
-		if (!ch) break;
+		/* Leaving also leaves the linked channel, don't step onto that one */
+		lcu = cu->channel->link ? channel_find_user(cu->channel->link, user) : NULL;
+		if (lcu && dn2 == &lcu->usernode) dn2 = dn2->next;
+
+		/* Remove the user from the channel */
+		channel_deluser(cu->channel, user, reason, !kill);
 	}
+	DLIST_LOOP2_END
 
 	/* Remove the user from the user list */
-	listnode_delete(server->users, su);
+	serveruser_destroy(su);
+}
+
+/* Longest list of nicks in one netsplit notice */
+#define SPLIT_NICKS 400
+
+/* Does <user> go away together with <server>? */
+#define server_splits(server, user) ((user)->server == (server) && !(user)->config)
+
+/* Announce the batch of nicks lost in the split of <split> on <ch> */
+static void server_split_notice(struct channel *ch, struct server *split, char *nicks, unsigned int *len)
+{
+	if (*len == 0) return;
+
+	/* From the user of the link itself, as nobody else said it */
+	channel_message(ch, ch->server->user, "### Netsplit of %s, quit: %s\n",
+		split->identity ? split->identity : split->hostname, nicks);
+
+	*len = 0;
+	nicks[0] = '\0';
+}
+
+/* Add <nick> to the batch, announcing the batch first when it is full */
+static void server_split_add(struct channel *ch, struct server *split, char *nicks, unsigned int *len, char *nick)
+{
+	unsigned int n = strlen(nick);
+
+	if (n + 1 >= SPLIT_NICKS) return;
+	if (*len + n + 1 >= SPLIT_NICKS) server_split_notice(ch, split, nicks, len);
+
+	if (*len > 0) nicks[(*len)++] = ' ';
+	memcpy(&nicks[*len], nick, n + 1);
+	*len += n;
 }
 
-/* Flush everything the server 'owns' */
+/*
+ * Flush everything the server 'owns', as the link is gone.
+ * All of it is done in a few linear passes:
+ * - nobody is on the channels of this server anymore
+ * - the users living behind this link quit, the other
+ *   links are told so in one batch per link
+ * - the serverusers are dropped, configured users are kept
+ */
 void server_flush(struct server *server)
 {
-	struct serveruser	*su;
+	struct serveruser	*su, *su2;
+	struct channeluser	*cu;
 	struct channel		*ch;
+	struct server		*srv;
+	struct user		*u;
 	struct listnode		*ln, *ln2;
+	struct dlistnode	*dn, *dn2, *dn3, *dn4;
+	char			nicks[SPLIT_NICKS], reason[256];
+	unsigned int		len = 0;
 
 	if (!server)
 	{
-		dolog(LOG_DEBUG, "server", "server_flush() - Something passed me an empty server!\n");
+		log_debug(server, "server_flush() - Something passed me an empty server!\n");
 		return;
 	}
 
-	/* Empty the users from the server */
-	while (server->users->count > 0)
+	/* Empty the channels of this server, there is nobody to tell */
+	LIST_LOOP(server->channels, ch, ln)
+	{
+		DLIST_LOOP2(&ch->users, cu, dn, dn2)
+		{
+			channeluser_destroy(cu);
+		}
+		DLIST_LOOP2_END
+	}
+
+	snprintf(reason, sizeof(reason), "%s %s",
+		g_conf->service_name ? g_conf->service_name : "talamasca",
+		server->identity ? server->identity : server->hostname);
+
+	/* Tell the other links about the users that went away */
+	LIST_LOOP(g_conf->servers, srv, ln)
 	{
-		LIST_LOOP(server->users, su, ln)
+		if (srv == server || srv->state != SS_CONNECTED) continue;
+
+		if (	srv->type == SRV_RFC1459 ||
+			srv->type == SRV_TS)
 		{
-			/* Keep Configured users */
-			if (su->user->config)
+			/* A QUIT also takes them off all the channels */
+			DLIST_LOOP(&server->users, su, dn)
 			{
-				/* User has been quit from the server */
-				su->introduced = false;
-	
-				/* Skip deletion as we want to keep this user */
-				continue;
-			}
+				if (!server_splits(server, su->user)) continue;
+				su2 = server_find_user(srv, su->user);
+				if (!su2 || !su2->introduced) continue;
 
-			/* Local user? then quit them */
-			if (su->user->server == server)
+				server_printf(srv, ":%s QUIT :%s\n", su->user->nick, reason);
+			}
+		}
+		else if (srv->type == SRV_USER ||
+			 srv->type == SRV_BITLBEE)
+		{
+			/* One notice per channel, the default channel hears about everybody */
+			LIST_LOOP(srv->channels, ch, ln2)
 			{
-				server_leave(server, su->user, "Flushing...", false);
+				if (ch == srv->defaultchannel)
+				{
+					DLIST_LOOP(&server->users, su, dn)
+					{
+						if (!server_splits(server, su->user)) continue;
+						su2 = server_find_user(srv, su->user);
+						if (!su2 || !su2->introduced) continue;
+
+						server_split_add(ch, server, nicks, &len, su->user->nick);
+					}
+				}
+				else
+				{
+					DLIST_LOOP(&ch->users, cu, dn)
+					{
+						if (!server_splits(server, cu->user) || !cu->introduced) continue;
+
+						server_split_add(ch, server, nicks, &len, cu->user->nick);
+					}
+				}
+				server_split_notice(ch, server, nicks, &len);
 			}
-	
-			/* Remove this serveruser from the list */
-			listnode_delete(server->users, su);
-			/* List changed so try again */
-			break;
 		}
-		if (!ln) break;
 	}
 
-	/*
-	 * By having the users leave the channels should be empty
-	 * As we ignore information about non-configured channels
-	 * we are back into prestine state
-	 */
+	/* Now drop them all silently */
+	DLIST_LOOP2(&server->users, su, dn, dn2)
+	{
+		u = su->user;
+
+		/* Keep Configured users */
+		if (u->config)
+		{
+			/* User has been quit from the server */
+			su->introduced = false;
+			continue;
+		}
+
+		serveruser_destroy(su);
+
+		/* Users of other links only lose their presence on this one */
+		if (u->server != server) continue;
+
+		DLIST_LOOP2(&u->channels, cu, dn3, dn4)
+		{
+			channeluser_destroy(cu);
+		}
+		DLIST_LOOP2_END
+
+		LIST_LOOP(g_conf->servers, srv, ln)
+		{
+			su2 = server_find_user(srv, u);
+			if (su2) serveruser_destroy(su2);
+		}
+
+		user_free(u);
+	}
+	DLIST_LOOP2_END
 }
 
 void server_disconnect(struct server *server)
 {
 	if (!server)
 	{
-		dolog(LOG_DEBUG, "server", "server_disconnect() - Something passed me an empty server!\n");
+		log_debug(server, "server_disconnect() - Something passed me an empty server!\n");
 		return;
 	}
 
-	/* Flush the users from the server */
+	/* Stop introducing, flush the users from the server */
+	server_burst_stop(server);
+	server->sjoin.channel = NULL;
 	server_flush(server);
 
 	/* Last time we where connected */
 	server->lastconnect = time(NULL);
 
+	/* Not connected yet but still resolving? -> stop that */
+	if (server->state == SS_RESOLVING)
+	{
+		resolve_cancel(server);
+		server->state = SS_DISCONNECTED;
+	}
+
+	/* The addresses of a connect in progress are not needed anymore */
+	server_connect_done(server);
+
 	/* Don't try this when it is closed already */
 	if (server->socket == -1) return;
 
 	/* TODO: send a QUIT/ERROR ? */
 
+	/* Last chance for whatever is still queued, without waiting for it */
+	if (server->state != SS_CONNECTING) sendq_flush(server->socket, &server->sendq);
+
 	/* Cleanup the socket */
-	FD_CLR(server->socket, &g_conf->selectset);
+	event_del(server->socket);
 	closesocket(server->socket);
 	server->socket = -1;
-	g_conf->numsocks--;
+
+	/* Whatever was not sent yet is lost */
+	sendq_free(&server->sendq);
+	server->sendq_exceeded = false;
+
+	/* And so is what was not processed yet */
+	linebuf_reset(&server->rbuf);
+
+	/* The next connection tells us its limits again */
+	server->maxtargets = 1;
+
+	server->state = SS_DISCONNECTED;
 }
 
 void server_change_identity(struct server *server, char *identity)
 {
 	if (!server)
 	{
-		dolog(LOG_DEBUG, "server", "change_identity() Something passed me a NULL server\n");
+		log_debug(server, "change_identity() Something passed me a NULL server\n");
 		return;
 	}
 
-	if (server->identity)	free(server->identity);
-	if (identity)		server->identity = strdup(identity);
-	else			server->identity = NULL;
+	identity = str_intern(identity);
+	str_release(server->identity);
+	server->identity = identity;
 }
 
 void server_change_description(struct server *server, char *description)
 {
 	if (!server)
 	{
-		dolog(LOG_DEBUG, "server", "change_description() Something passed me a NULL server\n");
+		log_debug(server, "change_description() Something passed me a NULL server\n");
 		return;
 	}
 
-	if (server->description)	free(server->description);
-	if (description)		server->description = strdup(description);
-	else				server->description = NULL;
+	description = str_intern(description);
+	str_release(server->description);
+	server->description = description;
+}
+
+/*
+ * Switch the casemapping of a link, refolding the keys of its channels
+ * The nick index is folded the same for every link, see user_find_nick()
+ */
+void server_change_casemapping(struct server *server, enum casemapping cm)
+{
+	struct channel		*ch;
+	struct listnode		*ln;
+
+	if (server->casemapping == cm) return;
+
+	log_debug(server, "%s:%s uses casemapping %s\n",
+		server->hostname, server->port, casemap_name(cm));
+	server->casemapping = cm;
+
+	LIST_LOOP(server->channels, ch, ln)
+	{
+		hash_delete(server->channelnames, casemap_hash(ch->foldname), ch);
+		str_release(ch->foldname);
+		ch->foldname = casemap_key(cm, ch->name);
+		hash_add(server->channelnames, casemap_hash(ch->foldname), ch);
+	}
 }
 
 void server_user_change_nick(struct server *server, struct user *user, char *oldnick)
@@ -536,13 +914,14 @@ void server_user_change_nick(struct server *server, struct user *user, char *old
 	struct channel	*ch;
 	struct listnode	*cn;
 	struct serveruser *su;
+	struct msgbuf	*body;
 
 	/* Try to find the user on the server */
 	su = server_find_user(server, user);
 	
 	if (!su)
 	{
-		dolog(LOG_WARNING, "server", "User %s!%s@%s was not introduced yet?! Introducing...\n",
+		log_warn(server, "User %s!%s@%s was not introduced yet?! Introducing...\n",
 			user->nick, user->ident, user->host);
 		su = server_introduce(server, user);
 	}
@@ -563,10 +942,12 @@ void server_user_change_nick(struct server *server, struct user *user, char *old
 	else
 	{
 		/* Notify all the different channels on this server */
+		body = msgbuf_line("### %s changed nick to %s", oldnick, user->nick);
 		LIST_LOOP(server->channels, ch, cn)
 		{
-			channel_message(ch, user, "### %s changed nick to %s", oldnick, user->nick);
+			channel_relay(ch, user, body);
 		}
+		msgbuf_release(body);
 	}
 }
 
@@ -597,7 +978,7 @@ struct irccmd
 };
 
 /* Modifies line, inserting \0's, putting pointers into cmd */
-bool server_parsestring(char *line, struct irccmd *cmd)
+bool server_parsestring(struct server *server, char *line, struct irccmd *cmd)
 {
 	char		*c = line, *p, *p2;
 	unsigned int	pi = 0;
@@ -649,7 +1030,7 @@ bool server_parsestring(char *line, struct irccmd *cmd)
 		p = strchr(c, ' ');
 		if (!p)
 		{
-			dolog(LOG_DEBUG, "parse", "no space found c=%x, line=%x\n", c, line);
+			log_debug(parse, "no space found c=%x, line=%x\n", c, line);
 			cmd->numargs = pi;
 			return false;
 		}
@@ -709,13 +1090,13 @@ bool server_parsestring(char *line, struct irccmd *cmd)
 	cmd->numargs = pi;
 
 /*
-	dolog(LOG_DEBUG, "parse", "src:%s, cmd:%s, num=%u, p0:%s, p1:%s, p2:%s, p3:%s, p4:%s, p5:%s\n",
+	log_debug(parse, "src:%s, cmd:%s, num=%u, p0:%s, p1:%s, p2:%s, p3:%s, p4:%s, p5:%s\n",
 		cmd->source, cmd->cmd, cmd->numargs, cmd->p[0], cmd->p[1], cmd->p[2], cmd->p[3], cmd->p[4], cmd->p[5]);
 */
 
 	/* Try to find the user belonging to this message */
 	/* FIXME: Verify that the origin is correct by comparing user->server */
-	if (cmd->source) cmd->user = user_find_nick(cmd->source);
+	if (cmd->source) cmd->user = user_find_nick(server, cmd->source);
 
 	return true;
 }
@@ -742,12 +1123,12 @@ void server_handle_bitlbee_root(struct server *server, struct irccmd *cmd)
 			((unsigned int)(c-cmd->p[1]))-6 > sizeof(tmp) ?
 			sizeof(tmp) : (unsigned int)(c-cmd->p[1])-6);
 
-		u = user_find_nick(tmp);
+		u = user_find_nick(server, tmp);
 		if (u)
 		{
 			if (u->server != server)
 			{
-				dolog(LOG_WARNING, "server", "Received a friendly name change for %s who is not from %s:%s but from %s:%s\n",
+				log_warn(server, "Received a friendly name change for %s who is not from %s:%s but from %s:%s\n",
 					tmp, server->hostname, server->port, u->server->hostname, u->server->port);
 				return;
 			}
@@ -761,7 +1142,7 @@ void server_handle_bitlbee_root(struct server *server, struct irccmd *cmd)
 		}
 		else
 		{
-			dolog(LOG_WARNING, "server", "Received friendly name change for non-existing user %s on %s!%s\n",
+			log_warn(server, "Received friendly name change for non-existing user %s on %s!%s\n",
 				tmp, server->hostname, server->port);
 			return;
 		}
@@ -803,7 +1184,7 @@ void server_handle_bitlbee_root(struct server *server, struct irccmd *cmd)
 	}
 
 #if 0
-	dolog(LOG_DEBUG, "server", "Ignoring message from root\n");
+	log_debug(server, "Ignoring message from root\n");
 #endif
 	return;
 }
@@ -815,7 +1196,7 @@ void server_handle_bitlbee_command(struct server *server, struct irccmd *cmd)
 	struct channeluser	*cu;
 	struct channel		*ch;
 	struct user		*u;
-	struct listnode		*ln;
+	struct dlistnode	*dn;
 
 	if (strcasecmp(cmd->p[1], "!help") == 0)
 	{
@@ -913,9 +1294,10 @@ void server_handle_bitlbee_command(struct server *server, struct irccmd *cmd)
 		LIST_LOOP(g_conf->servers, srv, ln)
 		{
 			server_printf(server,
-				"PRIVMSG %s :### %s 0 %llu %llu %llu %llu %u\n",
+				"PRIVMSG %s :### %s %u %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %u\n",
 				cmd->source,
 				srv->identity,
+				sendq_depth(&srv->sendq),
 				srv->stat_sent_msg,
 				srv->stat_sent_bytes/1024,
 				srv->stat_recv_msg,
@@ -1072,7 +1454,7 @@ void server_handle_bitlbee_command(struct server *server, struct irccmd *cmd)
 			}
 			else
 			{
-				dolog(LOG_DEBUG, "server", "No default channel is configured\n");
+				log_debug(server, "No default channel is configured\n");
 				return;
 			}
 			
@@ -1178,7 +1560,7 @@ void server_handle_bitlbee_command(struct server *server, struct irccmd *cmd)
 				"PRIVMSG %s :### Channel members:\n",
 				cmd->source, cmd->source);
 
-			LIST_LOOP(ch->users, cu, ln)
+			DLIST_LOOP(&ch->users, cu, dn)
 			{
 				if (!cu->introduced) return;
 				u = cu->user;
@@ -1209,7 +1591,7 @@ void server_handle_bitlbee_command(struct server *server, struct irccmd *cmd)
 	if (strncasecmp(cmd->p[1], "!whois ", 7) == 0)
 	{
 		/* Find the user */
-		u = user_find_nick(&cmd->p[1][7]);
+		u = user_find_nick(server, &cmd->p[1][7]);
 		if (!u)
 		{
 			server_printf(server,
@@ -1228,17 +1610,9 @@ void server_handle_bitlbee_command(struct server *server, struct irccmd *cmd)
 		server_printf(server,
 			"PRIVMSG %s :### Identity    : %s@%s\n",
 			cmd->source, u->ident, u->host);
-		LIST_LOOP(u->channels, ch, ln)
+		DLIST_LOOP(&u->channels, cu, dn)
 		{
-			/* Find the user on the channel */
-			cu = channel_find_user(ch, u);
-			/* Should not happen but still.... */
-			if (!cu)
-			{
-				dolog(LOG_WARNING, "server", "User %s!%s@%s is not really on %s\n",
-					u->nick, u->ident, u->host, ch->name);
-				continue;
-			}
+			ch = cu->channel;
 			server_printf(server,
 				"PRIVMSG %s :### Channel     : %s%s%s @ %s\n",
 				cmd->source,
@@ -1268,7 +1642,7 @@ void server_handle_bitlbee_command(struct server *server, struct irccmd *cmd)
 
 	if (strncasecmp(cmd->p[1], "!nick ", 6) == 0)
 	{
-		u = user_find_nick(&cmd->p[1][6]);
+		u = user_find_nick(server, &cmd->p[1][6]);
 		if (u)
 		{
 			server_printf(server,
@@ -1318,52 +1692,14 @@ void server_handle_privmsg(struct server *server, struct irccmd *cmd)
 	struct channeluser	*cu = NULL;
 	struct server		*srv = NULL;
 	struct listnode		*ln = NULL;
+	struct msgbuf		*body;
 	unsigned int		i;
 	bool			relay = true;
 
-	/* When it is a BitlBee */
-	if (server->type == SRV_BITLBEE)
-	{
-		/* Message from 'root', usually to #bitlbee ? */
-		if (strcasecmp(cmd->source, "root") == 0)
-		{
-			server_handle_bitlbee_root(server, cmd);
-			return;
-		}
-
-		if (cmd->p[1][0] == '!')
-		{
-			server_handle_bitlbee_command(server, cmd);
-			return;
-		}
-	}
-
-	/* No user for this source when it is a BitlBee server and not a command? */
-	if (	server->type == SRV_BITLBEE &&
-		!cmd->user)
-	{
-		server_printf(server,
-			"PRIVMSG %s :### You are currently not active, use !add first, also see !help\n",
-			cmd->source);
-		return;
-	}
-
-	/* Check for faulty nicknames */
-	if (	server->type == SRV_BITLBEE &&
-		!is_nickokay(cmd->source))
-	{
-		char tmp[20];
-
-		/* Change it */
-		if (!getfreenick(tmp, sizeof(tmp))) return;
-		server_printf(server, "PRIVMSG #bitlbee :rename %s %s\n", cmd->source, tmp);
-		return;
-	}
-
-	if (!cmd->user)
+	if (!cmd->user)
 	{
 		/* This can happen with a userlink server and out-of-channel-messages */
-		dolog(LOG_WARNING, "Received a message from %s!%s@%s who doesn't exist... requesting information\n",
+		log_warn(privmsg, "Received a message from %s!%s@%s who doesn't exist... requesting information\n",
 			cmd->source, cmd->ident, cmd->host);
 
 		/* Let's find out information about this person */
@@ -1388,16 +1724,16 @@ void server_handle_privmsg(struct server *server, struct irccmd *cmd)
 			/* Check for spaces in the nick, might be that somebody types something like: "Example Format: ..." */
 			if (!strstr(tmp, " "))
 			{
-				u = user_find_nick(tmp);
+				u = user_find_nick(server, tmp);
 				if (!u)
 				{
-					dolog(LOG_DEBUG, "privmsg", "Couldn't find target user %s\n", tmp);
+					log_debug(privmsg, "Couldn't find target user %s\n", tmp);
 					server_printf(server, "PRIVMSG %s :No such nick/channel %s\n",
 						cmd->source, tmp);
 					return;
 				}
 
-				dolog(LOG_DEBUG, "privmsg", "Treating it as a private message from %s to %s\n", cmd->source, tmp);
+				log_debug(privmsg, "Treating it as a private message from %s to %s\n", cmd->source, tmp);
 				relay = false;
 				/* Cut off the prefix */
 				cmd->p[1] = c+2;
@@ -1424,12 +1760,12 @@ void server_handle_privmsg(struct server *server, struct irccmd *cmd)
 		{
 			if (relay)
 			{
-				dolog(LOG_DEBUG, "privmsg", "No default channel on server %s:%s\n",
+				log_debug(privmsg, "No default channel on server %s:%s\n",
 					server->hostname, server->port);
 				return;
 			}
 
-			dolog(LOG_DEBUG, "privmsg", "Couldn't find channel %s on %s:%s\n",
+			log_debug(privmsg, "Couldn't find channel %s on %s:%s\n",
 				cmd->p[0], server->hostname, server->port);
 
 			if (	server->type == SRV_RFC1459 ||
@@ -1441,7 +1777,7 @@ void server_handle_privmsg(struct server *server, struct irccmd *cmd)
 			}
 			else if (server->type == SRV_P10)
 			{
-				dolog(LOG_DEBUG, "privmsg", "P10 is not implemented\n");
+				log_debug(privmsg, "P10 is not implemented\n");
 				exit(-42);
 			}
 			else if (server->type == SRV_BITLBEE ||
@@ -1456,7 +1792,7 @@ void server_handle_privmsg(struct server *server, struct irccmd *cmd)
 
 		if (!ch->link)
 		{
-			dolog(LOG_DEBUG, "privmsg", "Channel is not linked!?\n");
+			log_debug(privmsg, "Channel is not linked!?\n");
 			return;
 		}
 
@@ -1472,7 +1808,7 @@ void server_handle_privmsg(struct server *server, struct irccmd *cmd)
 			}
 			else if (server->type == SRV_P10)
 			{
-				dolog(LOG_DEBUG, "privmsg", "P10 is not implemented\n");
+				log_debug(privmsg, "P10 is not implemented\n");
 				exit(-42);
 			}
 			else if (server->type == SRV_BITLBEE ||
@@ -1485,25 +1821,29 @@ void server_handle_privmsg(struct server *server, struct irccmd *cmd)
 			return;
 		}
 
+		/* The message is shared by everybody it goes to */
+		body = msgbuf_line("%s", cmd->p[1]);
+
 		/* Do I need to bounce this back? */
 		if (relay && server->type == SRV_BITLBEE)
 		{
-			channel_message(ch, cmd->user, cmd->p[1]);
+			channel_relay(ch, cmd->user, body);
 		}
 		
 		/* Relay the message to the linked channel */
-		channel_message(ch->link, cmd->user, cmd->p[1]);
+		channel_relay(ch->link, cmd->user, body);
+		msgbuf_release(body);
 		return;
 	}
 
-	dolog(LOG_DEBUG, "privmsg", "Going for User to user messaging\n");
+	log_debug(privmsg, "Going for User to user messaging\n");
 
 	/* Figure out the target user (bitlbee+user already done above) */
 	if (	server->type == SRV_RFC1459 ||
 		server->type == SRV_TS)
 	{
 		/* Find the nick from the target */
-		u = user_find_nick(cmd->p[0]);
+		u = user_find_nick(server, cmd->p[0]);
 		if (!u)
 		{
 			server_printf(server,
@@ -1514,14 +1854,14 @@ void server_handle_privmsg(struct server *server, struct irccmd *cmd)
 	}
 	if (server->type == SRV_P10)
 	{
-		dolog(LOG_ERR, "privmsg", "P10 is not implemented\n");
+		log_err(privmsg, "P10 is not implemented\n");
 		exit(-42);
 	}
 
 	/* Did we find a user to relay this too? */
 	if (!u)
 	{
-		dolog(LOG_DEBUG, "privmsg", "Couldn't find nick %s for relaying - should not happen\n", cmd->p[0]);
+		log_debug(privmsg, "Couldn't find nick %s for relaying - should not happen\n", cmd->p[0]);
 		exit(-666);
 	}
 
@@ -1537,7 +1877,7 @@ void server_handle_privmsg(struct server *server, struct irccmd *cmd)
 
 	if (u->server->type == SRV_P10)
 	{
-		dolog(LOG_ERR, "privmsg", "P10 is not implemented\n");
+		log_err(privmsg, "P10 is not implemented\n");
 		exit(-42);
 	}
 
@@ -1547,6 +1887,45 @@ void server_handle_privmsg(struct server *server, struct irccmd *cmd)
 		u->nick, cmd->source, cmd->p[1]);
 }
 
+/* PRIVMSG on a BitlBee link, which can also be a command or from 'root' */
+void server_handle_bitlbee_privmsg(struct server *server, struct irccmd *cmd)
+{
+	char tmp[20];
+
+	/* Message from 'root', usually to #bitlbee ? */
+	if (strcasecmp(cmd->source, "root") == 0)
+	{
+		server_handle_bitlbee_root(server, cmd);
+		return;
+	}
+
+	if (cmd->p[1][0] == '!')
+	{
+		server_handle_bitlbee_command(server, cmd);
+		return;
+	}
+
+	/* No user for this source and not a command? */
+	if (!cmd->user)
+	{
+		server_printf(server,
+			"PRIVMSG %s :### You are currently not active, use !add first, also see !help\n",
+			cmd->source);
+		return;
+	}
+
+	/* Check for faulty nicknames */
+	if (!is_nickokay(cmd->source))
+	{
+		/* Change it */
+		if (!getfreenick(server, tmp, sizeof(tmp))) return;
+		server_printf(server, "PRIVMSG #bitlbee :rename %s %s\n", cmd->source, tmp);
+		return;
+	}
+
+	server_handle_privmsg(server, cmd);
+}
+
 /* source=who, p[0] = channel */
 void server_handle_join(struct server *server, struct irccmd *cmd)
 {
@@ -1558,11 +1937,11 @@ void server_handle_join(struct server *server, struct irccmd *cmd)
 		if (	server->type == SRV_BITLBEE &&
 			strcasecmp(cmd->source, "root") == 0)
 		{
-			dolog(LOG_DEBUG, "server", "Ignoring Delayed user_add() for root on a BitlBee server\n");
+			log_debug(server, "Ignoring Delayed user_add() for root on a BitlBee server\n");
 			return;
 		}
 
-		dolog(LOG_DEBUG, "server", "Delay adding user %s because of JOIN to %s\n", cmd->source, cmd->p[0]);
+		log_debug(server, "Delay adding user %s because of JOIN to %s\n", cmd->source, cmd->p[0]);
 		server_printf(server, "WHOIS %s\n", cmd->source);
 		return;
 	}
@@ -1600,7 +1979,7 @@ void server_handle_part(struct server *server, struct irccmd *cmd)
 
 	if (!cmd->user)
 	{
-		dolog(LOG_DEBUG, "server", "Received a part for unknown user %s on channel %s\n", cmd->source, cmd->p[0]);
+		log_debug(server, "Received a part for unknown user %s on channel %s\n", cmd->source, cmd->p[0]);
 	}
 	else if (
 		/* BitlBee server? */
@@ -1623,7 +2002,7 @@ void server_handle_quit(struct server *server, struct irccmd *cmd)
 {
 	if (!cmd->user)
 	{
-		dolog(LOG_DEBUG, "server", "Received a part for unknown user %s, reason: %s\n", cmd->source, cmd->p[0]);
+		log_debug(server, "Received a part for unknown user %s, reason: %s\n", cmd->source, cmd->p[0]);
 		return;
 	}
 	user_destroy(cmd->user, "Server quit");
@@ -1641,14 +2020,14 @@ void server_handle_kick(struct server *server, struct irccmd *cmd)
 	ch = server_find_channel(server, cmd->p[0]);
 	if (!ch)
 	{
-		dolog(LOG_DEBUG, "server", "Could not find channel %s where %s got kicked by %s with reason %s\n",
+		log_debug(server, "Could not find channel %s where %s got kicked by %s with reason %s\n",
 			cmd->p[0], cmd->p[1], cmd->source, cmd->p[2]);
 		return;
 	}
-	user = user_find_nick(cmd->p[1]);
+	user = user_find_nick(server, cmd->p[1]);
 	if (!user)
 	{
-		dolog(LOG_DEBUG, "server", "Could not find user %s who got kicked of %s by %s with reason %s\n",
+		log_debug(server, "Could not find user %s who got kicked of %s by %s with reason %s\n",
 			cmd->p[1], cmd->p[0], cmd->source, cmd->p[2]);
 		return;
 	}
@@ -1690,7 +2069,7 @@ void server_handle_mode(struct server *server, struct irccmd *cmd)
 		ch = server_find_channel(server, cmd->p[0]);
 		if (!ch)
 		{
-			dolog(LOG_DEBUG, "server", "Received mode change for unknown channel %s on %s:%s\n",
+			log_debug(server, "Received mode change for unknown channel %s on %s:%s\n",
 				cmd->p[0], server->hostname, server->port);
 			return;
 		}
@@ -1716,21 +2095,21 @@ void server_handle_mode(struct server *server, struct irccmd *cmd)
 			{
 				if (cmd->numargs <= off)
 				{
-					dolog(LOG_ERR, "server", "Received a %c mode change on channel %s but without a user\n",
+					log_err(server, "Received a %c mode change on channel %s but without a user\n",
 						*mode, ch->name);
 					return;
 				}
-				u = user_find_nick(cmd->p[off]);
+				u = user_find_nick(server, cmd->p[off]);
 				if (!u)
 				{
-					dolog(LOG_ERR, "server", "Received a %c mode change on channel %s for %s who does not exist\n",
+					log_err(server, "Received a %c mode change on channel %s for %s who does not exist\n",
 						*mode, ch->name, cmd->p[off]);
 					return;
 				}
 				cu = channel_find_user(ch, u);
 				if (!cu)
 				{
-					dolog(LOG_ERR, "server", "Received a %c mode change on channel %s for %s who is not on that channel\n",
+					log_err(server, "Received a %c mode change on channel %s for %s who is not on that channel\n",
 						*mode, ch->name, cmd->p[off]);
 					return;
 				}
@@ -1821,7 +2200,7 @@ void server_handle_mode(struct server *server, struct irccmd *cmd)
 					break;
 
 				default:
-					dolog(LOG_DEBUG, "server", "Received Unknown Channel Mode flag %c for %s on %s:%s\n",
+					log_debug(server, "Received Unknown Channel Mode flag %c for %s on %s:%s\n",
 						*mode, ch->name, server->hostname, server->port);
 					break;
 			}
@@ -1836,7 +2215,7 @@ void server_handle_away(struct server *server, struct irccmd *cmd)
 	/* Away changes */
 	if (!cmd->user)
 	{
-		dolog(LOG_DEBUG, "server", "Received away from unknown user '%s' (%p)\n",
+		log_debug(server, "Received away from unknown user '%s' (%p)\n",
 			cmd->source, cmd->user);
 		return;
 	}
@@ -1854,14 +2233,14 @@ void server_handle_nick(struct server *server, struct irccmd *cmd)
 	if (	server->type == SRV_BITLBEE &&
 		strcasecmp(cmd->p[0], "root") == 0)
 	{
-		dolog(LOG_DEBUG, "server", "Ignoring user_add() for root on a BitlBee server\n");
+		log_debug(server, "Ignoring user_add() for root on a BitlBee server\n");
 		return;
 	}
 
 	/* Server Join */
 	if (cmd->p[8] != NULL)
 	{
-		u = user_find_nick(cmd->p[0]);
+		u = user_find_nick(server, cmd->p[0]);
 		if (!u)
 		{
 			/* Didn't exist yet */
@@ -1874,7 +2253,7 @@ void server_handle_nick(struct server *server, struct irccmd *cmd)
 		else
 		{
 			/* Already exists -> Collision case */
-			dolog(LOG_ERR, "server", "Collision for nick %s\n", cmd->p[0]);
+			log_err(server, "Collision for nick %s\n", cmd->p[0]);
 			server_printf(server, ":%s KILL %s :That nickname is reserved, pick another one (SJ)\n",
 				server->name, cmd->p[0]);
 			return;
@@ -1883,10 +2262,10 @@ void server_handle_nick(struct server *server, struct irccmd *cmd)
 	/* Nick change */
 	else
 	{
-		u = user_find_nick(cmd->p[0]);
+		u = user_find_nick(server, cmd->p[0]);
 		if (u)
 		{
-			dolog(LOG_WARNING, "server", "Received a nick change while nick is already in use!\n");
+			log_warn(server, "Received a nick change while nick is already in use!\n");
 
 			if (	server->type == SRV_RFC1459 ||
 				server->type == SRV_TS)
@@ -1901,7 +2280,7 @@ void server_handle_nick(struct server *server, struct irccmd *cmd)
 			}
 			else if (server->type == SRV_P10)
 			{
-				dolog(LOG_DEBUG, "server", "Not implemented\n");
+				log_debug(server, "Not implemented\n");
 				exit(-42);
 			}
 			else
@@ -1912,14 +2291,14 @@ void server_handle_nick(struct server *server, struct irccmd *cmd)
 		}
 
 		/* Change the nick */
-		u = user_find_nick(cmd->source);
+		u = user_find_nick(server, cmd->source);
 		if (u)
 		{
 			user_change_nick(u, cmd->p[0], false);
 		}
 		else
 		{
-			dolog(LOG_WARNING, "server", "Unknown user %s changed name to %s, asking for information\n",
+			log_warn(server, "Unknown user %s changed name to %s, asking for information\n",
 				cmd->source, cmd->p[0]);
 			server_printf(server, "WHOIS %s\n", cmd->p[0]);
 		}
@@ -1930,7 +2309,7 @@ void server_handle_whois(struct server *server, struct irccmd *cmd)
 {
 	struct user		*u;
 	struct channel		*ch;
-	struct listnode		*ln;
+	struct dlistnode	*dn;
 	struct channeluser	*cu;
 	char			*nick;
 	unsigned int		i;
@@ -1938,13 +2317,13 @@ void server_handle_whois(struct server *server, struct irccmd *cmd)
 	if (cmd->numargs == 2) nick = cmd->p[1];
 	else nick = cmd->p[0];
 
-	u = user_find_nick(nick);
+	u = user_find_nick(server, nick);
 	if (!u)
 	{
 		server_printf(server,
 			":%s 401 %s %s :No such nick/channel\n",
 			server->name, cmd->source, nick);
-		dolog(LOG_WARNING, "server", "Unknown user %s during whois from %s\n",
+		log_warn(server, "Unknown user %s during whois from %s\n",
 			nick, cmd->source);
 		return;
 	}
@@ -1952,18 +2331,11 @@ void server_handle_whois(struct server *server, struct irccmd *cmd)
 		":%s 311 %s %s %s %s * :%s\n",
 		server->name, cmd->source, u->nick,
 		u->ident, u->host, u->realname);
-	LIST_LOOP(u->channels, ch, ln)
+	DLIST_LOOP(&u->channels, cu, dn)
 	{
+		ch = cu->channel;
 		/* Only show channels on the same server */
 		if (ch->server != server) continue;
-		cu = channel_find_user(ch, u);
-		/* User not in channel but on list!? */
-		if (!cu)
-		{
-			dolog(LOG_WARNING, "server", "User %s!%s@%s is not really on %s\n",
-				u->nick, u->ident, u->host, ch->name);
-			continue;
-		}
 		server_printf(server,
 			":%s 319 %s %s :%s%s%s\n",
 			server->name, cmd->source, u->nick,
@@ -1999,7 +2371,7 @@ void server_handle_topic(struct server *server, struct irccmd *cmd)
 	ch = server_find_channel(server, cmd->p[0]);
 	if (!ch)
 	{
-		dolog(LOG_DEBUG, "server", "Couldn't change topic for unknown channel %s\n", cmd->p[0]);
+		log_debug(server, "Couldn't change topic for unknown channel %s\n", cmd->p[0]);
 		return;
 	}
 
@@ -2023,7 +2395,7 @@ void server_handle_topic_332(struct server *server, struct irccmd *cmd)
 	ch = server_find_channel(server, cmd->p[1]);
 	if (!ch)
 	{
-		dolog(LOG_DEBUG, "server", "Couldn't change topic for unknown channel %s\n", cmd->p[1]);
+		log_debug(server, "Couldn't change topic for unknown channel %s\n", cmd->p[1]);
 		return;
 	}
 
@@ -2167,9 +2539,10 @@ void server_handle_stats(struct server *server, struct irccmd *cmd)
 		LIST_LOOP(g_conf->servers, srv, ln)
 		{
 			server_printf(server,
-				":%s 211 %s %s 0 %llu %llu %llu %llu %u\n",
+				":%s 211 %s %s %u %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %u\n",
 				server->name, cmd->source,
 				srv->identity,
+				sendq_depth(&srv->sendq),
 				srv->stat_sent_msg,
 				srv->stat_sent_bytes/1024,
 				srv->stat_recv_msg,
@@ -2194,42 +2567,186 @@ void server_handle_stats(struct server *server, struct irccmd *cmd)
 			server->name, cmd->source,
 			uptime_d, uptime_h, uptime_m, uptime_s);
 	}
+	else if (strcmp(cmd->p[0], "m") == 0)
+	{
+		/* Command usage */
+		server_commands_stats(server, cmd->source);
+	}
+	else if (strcmp(cmd->p[0], "z") == 0)
+	{
+		struct pool *pool;
+
+		/* Allocator occupancy and churn */
+		POOL_LOOP(pool)
+		{
+			server_printf(server,
+				":%s 249 %s z :%s %u/%u used, peak %u, %u slabs, %" PRIu64 " allocs, %" PRIu64 " frees\n",
+				server->name, cmd->source,
+				pool->name, pool->inuse, poolsize(pool), pool->peak,
+				pool->numslabs, pool->allocs, pool->frees);
+		}
+		server_printf(server,
+			":%s 249 %s z :strings %u interned\n",
+			server->name, cmd->source, str_interned());
+	}
 
 	server_printf(server,
 		":%s 219 %s %s :End of STATS report\n",
 		server->name, cmd->source, cmd->p[0]);
 }
 
-void server_handle_connected(struct server *server, struct irccmd *cmd)
+/* Microseconds between <a> and <b> */
+static unsigned long server_usecs(struct timeval *a, struct timeval *b)
 {
-	struct user	*u;
-	struct channel	*ch;
-	struct listnode	*ln, *ln2;
+	return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_usec - a->tv_usec);
+}
 
-	/* Welcome, we are connected */
-	server->state = SS_CONNECTED;
+/*
+ * Do one time slice of the burst of a link: first all our users get
+ * introduced, then they are added to each of the channels of the link.
+ * A slice ends after burst_lines steps or burst_usec microseconds,
+ * the rest waits till the other sockets have had their turn.
+ */
+void server_burst(struct server *server)
+{
+	struct burst		*b = &server->burst;
+	struct user		*u;
+	struct channel		*ch;
+	struct channeluser	*cu;
+	struct timeval		start, now;
+	unsigned int		steps = 0;
 
-	dolog(LOG_DEBUG, "server", "%s:%s is now in state: connected\n", server->hostname, server->port);
+	if (!b->active) return;
 
-	/* Introduce our users */
-	LIST_LOOP(g_conf->users, u, ln)
-	{
-		server_introduce(server, u);
-	}	
+	gettimeofday(&start, NULL);
+	b->slices++;
 
-	/* Introduce our channels */
-	LIST_LOOP(server->channels, ch, ln)
+	while (steps < g_conf->burst_lines)
 	{
-		/* Add all the channel users */
-		LIST_LOOP(g_conf->users, u, ln2)
+		/* Check the clock every now and then */
+		if ((steps & 15) == 15)
 		{
-			/* Don't join twice though */
-			if (channel_find_user(ch, u)) continue;
-			
-			/* Add the user to the channel */
-			channel_adduser(ch, u);
+			gettimeofday(&now, NULL);
+			if (server_usecs(&start, &now) >= g_conf->burst_usec) break;
 		}
+
+		/* Went through all the users? -> on to the (next) channel */
+		if (!b->user)
+		{
+			b->channel = b->channel ? b->channel->next : server->channels->head;
+			if (!b->channel)
+			{
+				gettimeofday(&now, NULL);
+				log_info(server, "Burst to %s:%s complete: %u steps in %u slices, %lu msec\n",
+					server->hostname, server->port, b->done, b->slices,
+					server_usecs(&b->start, &now) / 1000);
+				server_burst_stop(server);
+				channel_sjoin_flush(server);
+				return;
+			}
+			b->user = g_conf->users.head;
+			continue;
+		}
+
+		u = b->user->data;
+		b->user = b->user->next;
+		steps++;
+		b->done++;
+
+		/* Introduce our users */
+		if (!b->channel)
+		{
+			server_introduce(server, u);
+			continue;
+		}
+
+		/* Add all the users to the channel, but don't join twice */
+		ch = b->channel->data;
+		cu = channel_find_user(ch, u);
+		if (cu && cu->introduced) continue;
+		channel_adduser(ch, u);
 	}
+
+	log_debug(server, "Burst to %s:%s: %u steps done, at %s %s\n",
+		server->hostname, server->port, b->done,
+		b->channel ? "channel" : "users",
+		b->channel ? ((struct channel *)b->channel->data)->name : "");
+}
+
+/* Don't get ahead of what the link can take */
+#define server_burst_ready(s) ((s)->burst.active && sendq_depth(&(s)->sendq) < SENDQ_MAX / 4)
+
+/* Is there a burst that can continue right away? */
+bool server_burst_pending()
+{
+	struct server	*srv;
+	struct listnode	*ln;
+
+	if (g_conf->bursting == 0) return false;
+
+	LIST_LOOP(g_conf->servers, srv, ln)
+	{
+		if (server_burst_ready(srv)) return true;
+	}
+	return false;
+}
+
+/* Run a slice of every burst in progress */
+void server_burst_continue()
+{
+	struct server	*srv;
+	struct listnode	*ln;
+
+	if (g_conf->bursting == 0) return;
+
+	LIST_LOOP(g_conf->servers, srv, ln)
+	{
+		if (server_burst_ready(srv)) server_burst(srv);
+	}
+}
+
+/* A user goes away, move burst cursors pointing at it along */
+void server_burst_forget_user(struct user *user)
+{
+	struct server	*srv;
+	struct listnode	*ln;
+
+	if (g_conf->bursting == 0) return;
+
+	LIST_LOOP(g_conf->servers, srv, ln)
+	{
+		if (srv->burst.active && srv->burst.user == &user->node) srv->burst.user = user->node.next;
+	}
+}
+
+/* A channel goes away, continue with the next one when it was being filled */
+void server_burst_forget_channel(struct channel *channel)
+{
+	struct burst	*b = &channel->server->burst;
+
+	if (!b->active || !b->channel || b->channel->data != channel) return;
+
+	/* Step back, the next step moves on to the channel after it */
+	b->channel = b->channel->prev;
+	b->user = NULL;
+}
+
+void server_handle_connected(struct server *server, struct irccmd *cmd)
+{
+	/* Welcome, we are connected */
+	server->state = SS_CONNECTED;
+
+	log_debug(server, "%s:%s is now in state: connected\n", server->hostname, server->port);
+
+	/* Introduce our users and channels, a time slice at a time */
+	server_burst_stop(server);
+	memset(&server->burst, 0, sizeof(server->burst));
+	server->burst.active = true;
+	server->burst.user = g_conf->users.head;
+	gettimeofday(&server->burst.start, NULL);
+	g_conf->bursting++;
+
+	server_burst(server);
 }
 
 /* source = none, p0 = hostname/identity, p1 = hops, p2 = description */
@@ -2243,12 +2760,60 @@ void server_handle_server(struct server *server, struct irccmd *cmd)
 	server_change_description(server, cmd->p[2]);
 }
 
+/* Number of targets per message, an empty value means no limit */
+void server_change_maxtargets(struct server *server, const char *value)
+{
+	unsigned int max = atoi(value);
+
+	if (max == 0 || max > MAXTARGETS_MAX) max = MAXTARGETS_MAX;
+	server->maxtargets = max;
+
+	log_debug(server, "%s:%s accepts %u targets per message\n",
+		server->hostname, server->port, max);
+}
+
+/* ISUPPORT: 0=/me, 1..=TOKEN[=value], last=text */
+void server_handle_isupport(struct server *server, struct irccmd *cmd)
+{
+	enum casemapping	cm;
+	unsigned int		i;
+	char			*c;
+
+	for (i = 1; i < cmd->numargs; i++)
+	{
+		if (strncasecmp(cmd->p[i], "CASEMAPPING=", 12) == 0)
+		{
+			cm = casemap_find(&cmd->p[i][12]);
+			if (cm == CASEMAP_MAX)
+			{
+				log_warn(server, "%s:%s uses unknown casemapping %s, keeping %s\n",
+					server->hostname, server->port, &cmd->p[i][12], casemap_name(server->casemapping));
+				continue;
+			}
+			server_change_casemapping(server, cm);
+		}
+		else if (strncasecmp(cmd->p[i], "MAXTARGETS=", 11) == 0)
+		{
+			server_change_maxtargets(server, &cmd->p[i][11]);
+		}
+		else if (strncasecmp(cmd->p[i], "TARGMAX=", 8) == 0)
+		{
+			/* TARGMAX=PRIVMSG:4,NOTICE:4,... */
+			c = strcasestr(&cmd->p[i][8], "PRIVMSG:");
+			if (c) server_change_maxtargets(server, &c[8]);
+		}
+	}
+}
+
 void server_handle_sjoin(struct server *server, struct irccmd *cmd)
 {
-	struct user	*u;
-	struct channel	*ch;
-	char		*c, nick[1024];
-	unsigned int	i,j,k;
+	struct user		*u;
+	struct channel		*ch;
+	struct channeluser	*cu;
+	struct fielditer	it;
+	char			*c, nick[1024];
+	unsigned int		k;
+	bool			op, voice;
 
 	/* 0/1=timestamps, 2 = name, 3 = chanmode, 4/5 = multiple users + modes */
 	ch = server_find_channel(server, cmd->p[2]);
@@ -2259,41 +2824,51 @@ void server_handle_sjoin(struct server *server, struct irccmd *cmd)
 	}
 	if (strlen(cmd->p[4]) == 0) c = cmd->p[5];
 	else c = cmd->p[4];
-	i = countfields(c);
-	for (j = 1; j <= i; j++)
+	field_init(&it, c);
+	while (field_next(&it))
 	{
-		copyfield(c, j, nick, sizeof(nick));
-		if (	nick[0] == '@' ||			/* Channel Operator */
-			nick[0] == '+')				/* Voiced user */
-		{
-			k = 1;
-		}
-		else if ((nick[0] == '@' && nick[1] == '@') ||	/* Channel Creator */
-			 (nick[0] == '@' && nick[1] == '+'))	/* Ops + Voice */
+		/* Skip the status prefixes (@ Channel Operator, + Voiced user, @@ Channel Creator) */
+		op = voice = false;
+		for (k = 0; k < it.len && (it.field[k] == '@' || it.field[k] == '+'); k++)
 		{
-			k = 2;
+			if (it.field[k] == '@') op = true;
+			else voice = true;
 		}
-		else k = 0;
-		u = user_find_nick(&nick[k]);
+		if (k == it.len) continue;
+
+		it.field += k;
+		it.len -= k;
+		field_copy(&it, nick, sizeof(nick));
+		u = user_find_nick(server, nick);
 		if (u)
 		{
 			/* Don't add twice */
 			if (channel_find_user(ch, u)) continue;
-			channel_adduser(ch, u);
+
+			/* Join, remember the status so the linked channel gets it too, then pass it on */
+			channel_introduce(ch, u);
+			cu = channel_find_user(ch, u);
+			if (cu)
+			{
+				cu->f_operator = op;
+				cu->f_voice = voice;
+			}
+			if (ch->link) channel_introduce(ch->link, u);
 		}
 		else
 		{
-			dolog(LOG_ERR, "server", "Unknown user %s for channel %s\n", nick, cmd->p[2]);
+			log_err(server, "Unknown user %s for channel %s\n", nick, cmd->p[2]);
 		}
 	}
 }
 
 void server_handle_whois_353(struct server *server, struct irccmd *cmd)
 {
-	struct user	*u;
-	struct channel	*ch;
-	unsigned	i,j,k;
-	char		nick[1024];
+	struct user		*u;
+	struct channel		*ch;
+	struct fielditer	it;
+	unsigned int		k;
+	char			nick[1024];
 
 	/* 0 = nick, 1 = mode, 2 = chan, 3 = who */
 	ch = server_find_channel(server, cmd->p[2]);
@@ -2302,14 +2877,15 @@ void server_handle_whois_353(struct server *server, struct irccmd *cmd)
 		/* Create the channel */
 		ch = channel_add(server, cmd->p[2], NULL);
 	}
-	i = countfields(cmd->p[3]);
-	for (j = 1; j <= i; j++)
+	field_init(&it, cmd->p[3]);
+	while (field_next(&it))
 	{
-		copyfield(cmd->p[3], j, nick, sizeof(nick));
+		if (it.len == 0) continue;
+		field_copy(&it, nick, sizeof(nick));
 		if (	nick[0] == '@' ||
 			nick[0] == '+') k = 1;
 		else k = 0;
-		u = user_find_nick(&nick[k]);
+		u = user_find_nick(server, &nick[k]);
 		if (u)
 		{
 			if (u->server == server)
@@ -2319,7 +2895,7 @@ void server_handle_whois_353(struct server *server, struct irccmd *cmd)
 			}
 			else
 			{
-				dolog(LOG_DEBUG, "server", "User %s is not really on server %s:%s\n", u->nick, server->hostname, server->port);
+				log_debug(server, "User %s is not really on server %s:%s\n", u->nick, server->hostname, server->port);
 			}
 		}
 		else
@@ -2328,11 +2904,11 @@ void server_handle_whois_353(struct server *server, struct irccmd *cmd)
 			if (	server->type == SRV_BITLBEE &&
 				strcasecmp(&nick[k], "root") == 0)
 			{
-				dolog(LOG_DEBUG, "server", "Ignoring Delayed user add for root on a BitlBee server\n");
+				log_debug(server, "Ignoring Delayed user add for root on a BitlBee server\n");
 				continue;
 			}
 
-			dolog(LOG_DEBUG, "server", "Delay adding user %s caused by 353\n", &nick[k], cmd->p[2]);
+			log_debug(server, "Delay adding user %s caused by 353\n", &nick[k], cmd->p[2]);
 			server_printf(server, "WHOIS %s\n", &nick[k]);
 		}
 	}
@@ -2347,12 +2923,12 @@ void server_handle_whois_311(struct server *server, struct irccmd *cmd)
 	if (	server->type != SRV_BITLBEE &&
 		server->type != SRV_USER)
 	{
-		dolog(LOG_DEBUG, "server", "Received 311 reply on a server link\n");
+		log_debug(server, "Received 311 reply on a server link\n");
 		return;
 	}
 
 	/* 0=/me, 1=nick, 2=ident, 3=host, 4=server, 5=realname */
-	u = user_find_nick(cmd->p[1]);
+	u = user_find_nick(server, cmd->p[1]);
 	
 	/* Somebody else ? */
 	if (u && server != u->server)
@@ -2360,12 +2936,12 @@ void server_handle_whois_311(struct server *server, struct irccmd *cmd)
 		char tmp[20];
 
 		/* Already exists -> Collision case */
-		dolog(LOG_ERR, "server", "Collision for nick %s\n", cmd->p[1]);
+		log_err(server, "Collision for nick %s\n", cmd->p[1]);
 		
 		/* Can't do anything on normal user links */
 		if (server->type != SRV_BITLBEE) return;
 
-		if (!getfreenick(tmp, sizeof(tmp))) return;
+		if (!getfreenick(server, tmp, sizeof(tmp))) return;
 
 		/* On BitlBee try to rename the user to something else */
 		server_printf(server, "PRIVMSG #bitlbee :rename %s %s\n",
@@ -2387,7 +2963,7 @@ void server_handle_whois_311(struct server *server, struct irccmd *cmd)
 	u = user_add(cmd->p[1], server, false);
 	if (!u)
 	{
-		dolog(LOG_WARNING, "server", "User addition failed!?\n");
+		log_warn(server, "User addition failed!?\n");
 		return;
 	}
 	user_change_ident(u, cmd->p[2]);
@@ -2404,7 +2980,7 @@ void server_handle_whois_311(struct server *server, struct irccmd *cmd)
 	ch = server_find_channel(server, "#bitlbee");
 	if (!ch)
 	{
-		dolog(LOG_WARNING, "server", "No #bitlbee channel on a BitlBee linked server!?\n");
+		log_warn(server, "No #bitlbee channel on a BitlBee linked server!?\n");
 		return;
 	}
 
@@ -2420,16 +2996,16 @@ void server_handle_whois_311(struct server *server, struct irccmd *cmd)
 
 void server_handle_whois_319(struct server *server, struct irccmd *cmd)
 {
-	struct channel	*ch;
-	struct user	*u;
-	unsigned int	i,j;
-	char		channame[1024];
+	struct channel		*ch;
+	struct user		*u;
+	struct fielditer	it;
+	char			channame[1024];
 
 	/* We only want these on user links */
 	if (	server->type != SRV_BITLBEE &&
 		server->type != SRV_USER)
 	{
-		dolog(LOG_DEBUG, "server", "Received 319 reply on a server link\n");
+		log_debug(server, "Received 319 reply on a server link\n");
 		return;
 	}
 
@@ -2437,24 +3013,25 @@ void server_handle_whois_319(struct server *server, struct irccmd *cmd)
 	 * 319's are a result of a whois and we should have the user info already ;)
 	 * 0=/me, 1=nick, 2=channels
 	 */
-	u = user_find_nick(cmd->p[1]);
+	u = user_find_nick(server, cmd->p[1]);
 	if (!u)
 	{
-		dolog(LOG_WARNING, "server", "Unknown user %s when receiving a 319\n", cmd->p[1]);
+		log_warn(server, "Unknown user %s when receiving a 319\n", cmd->p[1]);
 		return;
 	}
 
-	i = countfields(cmd->p[2]);
-	for (j = 1; j <= i; j++)
+	field_init(&it, cmd->p[2]);
+	while (field_next(&it))
 	{
-		copyfield(cmd->p[2], j, channame, sizeof(channame));
+		if (it.len == 0) continue;
+		field_copy(&it, channame, sizeof(channame));
 		ch = server_find_channel(server, channame);
 		if (ch)
 		{
 			if (channel_find_user(ch, cmd->user)) continue;
 			channel_adduser(ch, cmd->user);
 		}
-		else dolog(LOG_DEBUG, "server", "Unknown channel %s\n", channame);
+		else log_debug(server, "Unknown channel %s\n", channame);
 	}
 }
 
@@ -2468,12 +3045,12 @@ void server_handle_whois_301(struct server *server, struct irccmd *cmd)
 	if (	server->type != SRV_BITLBEE &&
 		server->type != SRV_USER)
 	{
-		dolog(LOG_DEBUG, "server", "Received 301 reply on a server link\n");
+		log_debug(server, "Received 301 reply on a server link\n");
 		return;
 	}
 
 	/* 0=/me, 1=nick, 2=reason */
-	u = user_find_nick(cmd->p[1]);
+	u = user_find_nick(server, cmd->p[1]);
 
 	/* Update the away */	
 	user_change_away(u, cmd->p[2]);
@@ -2486,10 +3063,10 @@ void server_handle_badnick(struct server *server, struct irccmd *cmd)
 	unsigned int	i = 0;
 	struct user	*u = NULL;
 
-	u = user_find_nick(cmd->p[1]);
+	u = user_find_nick(server, cmd->p[1]);
 	if (!u)
 	{
-		dolog(LOG_DEBUG, "server", "%s has a bad nick but is not known to me\n",
+		log_debug(server, "%s has a bad nick but is not known to me\n",
 			cmd->p[1]);
 		return;
 	}
@@ -2498,7 +3075,7 @@ void server_handle_badnick(struct server *server, struct irccmd *cmd)
 	if (u->server->type != SRV_BITLBEE) return;
 
 	/* Try to rename the user to some standard name */
-	if (!getfreenick(tmp, sizeof(tmp))) return;
+	if (!getfreenick(server, tmp, sizeof(tmp))) return;
 
 	/* Remove the user from the server */
 	server_leave(server, u, "Bad nickname, changing it", false);
@@ -2515,11 +3092,11 @@ void server_handle_kill(struct server *server, struct irccmd *cmd)
 	char		reason[1024];
 	struct user	*u;
 	
-	u = user_find_nick(cmd->p[0]);
+	u = user_find_nick(server, cmd->p[0]);
 
 	if (!u)
 	{
-		dolog(LOG_DEBUG, "server", "%s got killed on %s:%s but is not known to me\n",
+		log_debug(server, "%s got killed on %s:%s but is not known to me\n",
 			cmd->p[0], server->hostname, server->port);
 		return;
 	}
@@ -2530,11 +3107,257 @@ void server_handle_kill(struct server *server, struct irccmd *cmd)
 	server_leave(server, u, reason, true);
 }
 
+/* The commands we know about, index into server_commands[] */
+enum server_cmds
+{
+	SC_UNKNOWN = 0,
+
+	/* Verbs */
+	SC_PRIVMSG, SC_QUIT, SC_MODE, SC_AWAY, SC_NICK, SC_WHOIS,
+	SC_JOIN, SC_PART, SC_KICK, SC_TOPIC,
+	SC_VERSION, SC_INFO, SC_ADMIN, SC_MOTD, SC_TIME, SC_STATS,
+	SC_SERVER, SC_SJOIN, SC_KILL, SC_ERROR, SC_SQUIT,
+	SC_NOTICE, SC_GNOTICE, SC_PASS, SC_SVINFO, SC_CAPAB,
+
+	/* Numerics */
+	SC_001, SC_002, SC_003, SC_004, SC_005,
+	SC_221, SC_251, SC_252, SC_253, SC_254, SC_255, SC_265, SC_266,
+	SC_301, SC_311, SC_312, SC_317, SC_318, SC_319,
+	SC_332, SC_333, SC_353, SC_366, SC_372, SC_375, SC_376,
+	SC_401, SC_432, SC_442,
+
+	SC_MAX
+};
+
+/* Flags for server_commands[] */
+#define SCF_IGNORE	0x01		/* Known, but nothing to do */
+#define SCF_DISCONNECT	0x02		/* The link goes away */
+
+struct server_command
+{
+	const char	*name;
+	void		(*handler)(struct server *server, struct irccmd *cmd);
+	unsigned int	flags;
+	uint64_t	hits;		/* Number of times received */
+};
+
+static struct server_command server_commands[SC_MAX] =
+{
+	[SC_UNKNOWN]	= { "UNKNOWN",	NULL,				SCF_IGNORE },
+
+	/* User related */
+	[SC_PRIVMSG]	= { "PRIVMSG",	server_handle_privmsg,		0 },
+	[SC_QUIT]	= { "QUIT",	server_handle_quit,		0 },
+	[SC_MODE]	= { "MODE",	server_handle_mode,		0 },
+	[SC_AWAY]	= { "AWAY",	server_handle_away,		0 },
+	[SC_NICK]	= { "NICK",	server_handle_nick,		0 },
+	[SC_WHOIS]	= { "WHOIS",	server_handle_whois,		0 },
+	[SC_001]	= { "001",	server_handle_connected,	0 },
+	[SC_005]	= { "005",	server_handle_isupport,		0 },
+
+	/* Channel related */
+	[SC_JOIN]	= { "JOIN",	server_handle_join,		0 },
+	[SC_PART]	= { "PART",	server_handle_part,		0 },
+	[SC_KICK]	= { "KICK",	server_handle_kick,		0 },
+	[SC_TOPIC]	= { "TOPIC",	server_handle_topic,		0 },
+	[SC_332]	= { "332",	server_handle_topic_332,	0 },
+	[SC_333]	= { "333",	server_handle_topic_333,	0 },
+
+	/*
+	 * Silly interface commands to let people see this is a real Talamasca ;)
+	 * and to make it implement most of the IRC commands
+	 */
+	[SC_VERSION]	= { "VERSION",	server_handle_version,		0 },
+	[SC_INFO]	= { "INFO",	server_handle_info,		0 },
+	[SC_ADMIN]	= { "ADMIN",	server_handle_admin,		0 },
+	[SC_MOTD]	= { "MOTD",	server_handle_motd,		0 },
+	[SC_TIME]	= { "TIME",	server_handle_time,		0 },
+	[SC_STATS]	= { "STATS",	server_handle_stats,		0 },
+
+	/* Server<->Server commands */
+	[SC_SERVER]	= { "SERVER",	server_handle_server,		0 },
+	[SC_SJOIN]	= { "SJOIN",	server_handle_sjoin,		0 },
+
+	[SC_353]	= { "353",	server_handle_whois_353,	0 },
+	[SC_311]	= { "311",	server_handle_whois_311,	0 },
+	[SC_319]	= { "319",	server_handle_whois_319,	0 },
+	[SC_301]	= { "301",	server_handle_whois_301,	0 },
+
+	[SC_432]	= { "432",	server_handle_badnick,		0 },
+
+	[SC_KILL]	= { "KILL",	server_handle_kill,		0 },
+
+	/* Disconnecting commands */
+	[SC_ERROR]	= { "ERROR",	NULL,				SCF_DISCONNECT },
+	[SC_SQUIT]	= { "SQUIT",	NULL,				SCF_DISCONNECT },
+
+	/* Ignores */
+	[SC_NOTICE]	= { "NOTICE",	NULL,	SCF_IGNORE },	/* Notice */
+	[SC_GNOTICE]	= { "GNOTICE",	NULL,	SCF_IGNORE },	/* Server Notice */
+	[SC_PASS]	= { "PASS",	NULL,	SCF_IGNORE },	/* Password */
+	[SC_SVINFO]	= { "SVINFO",	NULL,	SCF_IGNORE },	/* Server information */
+	[SC_CAPAB]	= { "CAPAB",	NULL,	SCF_IGNORE },	/* Server capabilities */
+
+	[SC_002]	= { "002",	NULL,	SCF_IGNORE },	/* Server version */
+	[SC_003]	= { "003",	NULL,	SCF_IGNORE },	/* Server creation */
+	[SC_004]	= { "004",	NULL,	SCF_IGNORE },	/* Server options */
+
+	[SC_221]	= { "221",	NULL,	SCF_IGNORE },	/* User mode (set by server) */
+
+	[SC_251]	= { "251",	NULL,	SCF_IGNORE },	/* stat: user count */
+	[SC_252]	= { "252",	NULL,	SCF_IGNORE },	/* stat: # IRC Operators */
+	[SC_253]	= { "253",	NULL,	SCF_IGNORE },	/* stat: # Unknown Connection */
+	[SC_254]	= { "254",	NULL,	SCF_IGNORE },	/* stat: # channels */
+	[SC_255]	= { "255",	NULL,	SCF_IGNORE },	/* stat: # clients & servers */
+	[SC_265]	= { "265",	NULL,	SCF_IGNORE },	/* stat: # local users */
+	[SC_266]	= { "266",	NULL,	SCF_IGNORE },	/* stat: # global users */
+
+	[SC_312]	= { "312",	NULL,	SCF_IGNORE },	/* whois: server */
+	[SC_317]	= { "317",	NULL,	SCF_IGNORE },	/* whois: idle/signon */
+	[SC_318]	= { "318",	NULL,	SCF_IGNORE },	/* whois: end */
+
+	[SC_366]	= { "366",	NULL,	SCF_IGNORE },	/* names: end */
+
+	[SC_372]	= { "372",	NULL,	SCF_IGNORE },	/* motd: line */
+	[SC_375]	= { "375",	NULL,	SCF_IGNORE },	/* motd: start */
+	[SC_376]	= { "376",	NULL,	SCF_IGNORE },	/* motd: end */
+
+	[SC_401]	= { "401",	NULL,	SCF_IGNORE },	/* Unknown nick/channel */
+	[SC_442]	= { "442",	NULL,	SCF_IGNORE },	/* User is not on that channel */
+};
+
+/* Per server type replacements of the handlers above */
+static struct
+{
+	enum srv_types	type;
+	unsigned int	id;
+	void		(*handler)(struct server *server, struct irccmd *cmd);
+} server_overrides[] =
+{
+	{ SRV_BITLBEE,	SC_PRIVMSG,	server_handle_bitlbee_privmsg },
+};
+
+/*
+ * Perfect hash over the verbs, the slots below are computed from it,
+ * server_commands_init() refuses to start when they don't match anymore
+ * Verbs are letters only, thus & 0xDF uppercases them
+ */
+#define SERVER_VERBHASH(s, len) \
+	(((len)*4 + ((s)[0] & 0xDF) + ((s)[1] & 0xDF) + ((s)[(len)-1] & 0xDF)*4) & 63)
+
+static const unsigned char server_verbs[64] =
+{
+	[ 0] = SC_MODE,		[ 1] = SC_TIME,		[ 3] = SC_TOPIC,	[ 5] = SC_GNOTICE,
+	[ 6] = SC_QUIT,		[ 7] = SC_STATS,	[ 8] = SC_SQUIT,	[ 9] = SC_NOTICE,
+	[12] = SC_AWAY,		[16] = SC_KICK,		[17] = SC_ADMIN,	[19] = SC_NICK,
+	[20] = SC_KILL,		[26] = SC_PRIVMSG,	[32] = SC_CAPAB,	[33] = SC_JOIN,
+	[35] = SC_INFO,		[41] = SC_SJOIN,	[45] = SC_PASS,		[47] = SC_VERSION,
+	[49] = SC_PART,		[51] = SC_ERROR,	[56] = SC_SERVER,	[60] = SC_MOTD,
+	[61] = SC_SVINFO,	[63] = SC_WHOIS,
+};
+
+/* Numerics, directly indexed */
+static unsigned char server_numerics[1000];
+
+/* The handlers in use per server type */
+static void (*server_handlers[SRV_P10+1][SC_MAX])(struct server *server, struct irccmd *cmd);
+
+/*
+ * Fill the dispatch tables and check that every command has a slot of
+ * its own, server_command_find() relies on that and only compares once
+ */
+void server_commands_init()
+{
+	const char	*name;
+	unsigned int	id, t, i, slot;
+
+	for (id = SC_UNKNOWN+1; id < SC_MAX; id++)
+	{
+		name = server_commands[id].name;
+
+		if (isdigit(name[0]))
+		{
+			slot = atoi(name);
+			if (server_numerics[slot] != SC_UNKNOWN)
+			{
+				log_err(server, "Numeric %s is listed twice in server_commands[]\n", name);
+				exit(-1);
+			}
+			server_numerics[slot] = id;
+		}
+		else if (server_verbs[SERVER_VERBHASH(name, strlen(name))] != id)
+		{
+			log_err(server, "Verb %s is not in its hash slot %u, fix server_verbs[]\n",
+				name, SERVER_VERBHASH(name, strlen(name)));
+			exit(-1);
+		}
+
+		for (t = 0; t <= SRV_P10; t++) server_handlers[t][id] = server_commands[id].handler;
+	}
+
+	/* Nothing else may be in a slot, the lookup would find the wrong command */
+	for (slot = 0; slot < sizeof(server_verbs); slot++)
+	{
+		id = server_verbs[slot];
+		if (id == SC_UNKNOWN) continue;
+
+		name = server_commands[id].name;
+		if (isdigit(name[0]) || SERVER_VERBHASH(name, strlen(name)) != slot)
+		{
+			log_err(server, "Hash slot %u holds %s which belongs elsewhere, fix server_verbs[]\n",
+				slot, name);
+			exit(-1);
+		}
+	}
+
+	for (i = 0; i < sizeof(server_overrides)/sizeof(server_overrides[0]); i++)
+	{
+		server_handlers[server_overrides[i].type][server_overrides[i].id] = server_overrides[i].handler;
+	}
+}
+
+/*
+ * Numerics are looked up directly, verbs through the perfect hash,
+ * checked by server_commands_init() thus one compare tells whether it is the one
+ */
+static unsigned int server_command_find(const char *cmd)
+{
+	unsigned int id, len = strlen(cmd);
+
+	if (	len == 3 &&
+		isdigit(cmd[0]) && isdigit(cmd[1]) && isdigit(cmd[2]))
+	{
+		return server_numerics[(cmd[0]-'0')*100 + (cmd[1]-'0')*10 + (cmd[2]-'0')];
+	}
+
+	if (len < 2) return SC_UNKNOWN;
+
+	id = server_verbs[SERVER_VERBHASH(cmd, len)];
+	if (strcasecmp(server_commands[id].name, cmd) != 0) return SC_UNKNOWN;
+	return id;
+}
+
+/* STATS m, how often every command was seen */
+void server_commands_stats(struct server *server, const char *source)
+{
+	unsigned int id;
+
+	for (id = 0; id < SC_MAX; id++)
+	{
+		if (server_commands[id].hits == 0) continue;
+
+		server_printf(server,
+			":%s 212 %s %s %" PRIu64 "\n",
+			server->name, source,
+			server_commands[id].name, server_commands[id].hits);
+	}
+}
+
 void server_handle(struct server *server)
 {
 	int		sret;
-	unsigned int	i, j, k, loops = 0;
-	char		line[BUFFERSIZE], nick[BUFFERSIZE], *c;
+	unsigned int	i, j, k, loops = 0, linelen, id;
+	char		*line, nick[BUFFERSIZE], *c;
 	struct irccmd	cmd;
 	struct server	*srv = NULL;
 	struct channel	*ch = NULL;
@@ -2544,20 +3367,23 @@ void server_handle(struct server *server)
 	/* Not connected? Exit, should not happen */
 	if (server->socket == -1)
 	{
-		dolog(LOG_ERR, "server", "server_handle() with -1 socket...\n");
+		log_err(server, "server_handle() with -1 socket...\n");
 		exit(-1);
 	}
 
-	while ((sret = sock_getline(server->socket, server->buffer, sizeof(server->buffer), &server->bufferfill, line, sizeof(line))) > 0)
+	while ((sret = sock_getline(server->socket, &server->rbuf, &line, &linelen)) > 0)
 	{
 		loops++;
 
-		/* dolog(LOG_DEBUG, "server", "[%s@%s:%s] handle(%s)\n", server->name, server->hostname, server->port, line); */
+		/* log_debug(server, "[%s@%s:%s] handle(%s)\n", server->name, server->hostname, server->port, line); */
 
 		/* Update received counters */
 		server->stat_recv_msg++;
 		server->stat_recv_bytes += sret;
 
+		/* Nothing to parse */
+		if (linelen == 0) continue;
+
 		/* Shortcut for pingponging */
 		if (strncmp("PING", line, 4) == 0)
 		{
@@ -2565,115 +3391,84 @@ void server_handle(struct server *server)
 			continue;
 		}
 
-		if (!server_parsestring(line, &cmd))
+		if (!server_parsestring(server, line, &cmd))
 		{
-			dolog(LOG_ERR, "server", "Parse error?\n");
+			log_err(server, "Parse error?\n");
 			continue;
 		}
 
-		/* User related */
-		if	(strcasecmp(cmd.cmd, "PRIVMSG") == 0)	server_handle_privmsg	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "QUIT") == 0)	server_handle_quit	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "MODE") == 0)	server_handle_mode	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "AWAY") == 0)	server_handle_away	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "NICK") == 0)	server_handle_nick	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "WHOIS") == 0)	server_handle_whois	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "001") == 0)	server_handle_connected	(server, &cmd);
-
-		/* Channel related */
-		else if (strcasecmp(cmd.cmd, "JOIN") == 0)	server_handle_join	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "PART") == 0)	server_handle_part	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "KICK") == 0)	server_handle_kick	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "TOPIC") == 0)	server_handle_topic	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "332") == 0)	server_handle_topic_332	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "333") == 0)	server_handle_topic_333	(server, &cmd);
-
-		/*
-		 * Silly interface commands to let people see this is a real Talamasca ;)
-		 * and to make it implement most of the IRC commands
-		 */
-		else if (strcasecmp(cmd.cmd, "VERSION") == 0)	server_handle_version	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "INFO") == 0)	server_handle_info	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "ADMIN") == 0)	server_handle_admin	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "MOTD") == 0)	server_handle_motd	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "TIME") == 0)	server_handle_time	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "STATS") == 0)	server_handle_stats	(server, &cmd);
-
-		/* Server<->Server commands */
-		else if (strcasecmp(cmd.cmd, "SERVER") == 0)	server_handle_server	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "SJOIN") == 0)	server_handle_sjoin	(server, &cmd);
-
-		else if (strcasecmp(cmd.cmd, "353") == 0)	server_handle_whois_353	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "311") == 0)	server_handle_whois_311	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "319") == 0)	server_handle_whois_319	(server, &cmd);
-		else if (strcasecmp(cmd.cmd, "301") == 0)	server_handle_whois_301 (server, &cmd);
-
-		else if (strcasecmp(cmd.cmd, "432") == 0)	server_handle_badnick	(server, &cmd);
+		id = server_command_find(cmd.cmd);
+		server_commands[id].hits++;
 
-		else if (strcasecmp(cmd.cmd, "KILL") == 0)	server_handle_kill	(server, &cmd);
-
-		/* Disconnecting commands */
-		else if (strcasecmp(cmd.cmd, "ERROR") == 0 ||
-			 strcasecmp(cmd.cmd, "SQUIT") == 0)
+		/* Disconnecting commands, set an error and break out of the loop */
+		if (server_commands[id].flags & SCF_DISCONNECT)
 		{
-			/* Set an error and break out of the loop */
 			sret = -2;
 			break;
 		}
 
-		/* Ignores */
-		else if (strcasecmp(cmd.cmd, "NOTICE") == 0 ||	/* Notice */
-			 strcasecmp(cmd.cmd, "GNOTICE") == 0 ||	/* Server Notice */
-			 strcasecmp(cmd.cmd, "PASS") == 0 ||	/* Password */
-			 strcasecmp(cmd.cmd, "SVINFO") == 0 ||	/* Server information */
-			 strcasecmp(cmd.cmd, "CAPAB") == 0 ||	/* Server capabilities */
-
-			 strcasecmp(cmd.cmd, "002") == 0 ||	/* Server version */
-			 strcasecmp(cmd.cmd, "003") == 0 ||	/* Server creation */
-			 strcasecmp(cmd.cmd, "004") == 0 ||	/* Server options */
-			 strcasecmp(cmd.cmd, "005") == 0 ||	/* Server haves */
-
-			 strcasecmp(cmd.cmd, "221") == 0 ||	/* User mode (set by server) */
-
-			 strcasecmp(cmd.cmd, "251") == 0 ||	/* stat: user count */
-			 strcasecmp(cmd.cmd, "252") == 0 ||	/* stat: # IRC Operators */
-			 strcasecmp(cmd.cmd, "253") == 0 ||	/* stat: # Unknown Connection */
-			 strcasecmp(cmd.cmd, "254") == 0 ||	/* stat: # channels */
-			 strcasecmp(cmd.cmd, "255") == 0 ||	/* stat: # clients & servers */
-			 strcasecmp(cmd.cmd, "265") == 0 ||	/* stat: # local users */
-			 strcasecmp(cmd.cmd, "266") == 0 ||	/* stat: # global users */
-
-			 strcasecmp(cmd.cmd, "312") == 0 ||	/* whois: server */
-			 strcasecmp(cmd.cmd, "317") == 0 ||	/* whois: idle/signon */
-			 strcasecmp(cmd.cmd, "318") == 0 ||	/* whois: end */
-			 
-			 strcasecmp(cmd.cmd, "366") == 0 ||	/* names: end */
-
-			 strcasecmp(cmd.cmd, "372") == 0 ||	/* motd: line */
-			 strcasecmp(cmd.cmd, "375") == 0 ||	/* motd: start */
-			 strcasecmp(cmd.cmd, "376") == 0 ||	/* motd: end */
-			 
-			 strcasecmp(cmd.cmd, "401") == 0 ||	/* Unknown nick/channel */
-			 strcasecmp(cmd.cmd, "442") == 0)	/* User is not on that channel */
+		if (server_handlers[server->type][id])
 		{
-			/* Ignore */
+			server_handlers[server->type][id](server, &cmd);
 		}
-		else
+		else if (id == SC_UNKNOWN)
 		{
-			dolog(LOG_DEBUG, "server", "[%s@%s:%s] Ignoring unknown cmd '%s'\n", server->name, server->hostname, server->port, cmd.cmd);
+			log_debug(server, "[%s@%s:%s] Ignoring unknown cmd '%s'\n", server->name, server->hostname, server->port, cmd.cmd);
 		}
 	}
 
 	if (sret == 0)
 	{
-		/*dolog(LOG_DEBUG, "server", "Didn't receive a thing on %s:%s after %u loops\n", server->hostname, server->port, loops);*/
-		if (loops == 0) server_disconnect(server);
+		/*
+		 * No (more) complete lines, which can also happen on the
+		 * first try when only part of a line came in, EOF is an error
+		 */
+		/*log_debug(server, "Didn't receive a thing on %s:%s after %u loops\n", server->hostname, server->port, loops);*/
 		return;
 	}
 	else if (sret < 0)
 	{
-		dolog(LOG_DEBUG, "server", "[%s@%s:%s] Got an error (%i), disconnecting: %s (%d)\n", server->name, server->hostname, server->port, sret, strerror(errno), errno);
+		log_debug(server, "[%s@%s:%s] Got an error (%i), disconnecting: %s (%d)\n", server->name, server->hostname, server->port, sret, strerror(errno), errno);
 		server_disconnect(server);
 	}
 }
 
+
+/* Called from the event loop when our socket is ready */
+void server_event(SOCKET sock, unsigned int events, void *data)
+{
+	struct server	*server = (struct server *)data;
+	int		err = 0;
+	socklen_t	len = sizeof(err);
+
+	/* Our non-blocking connect finished, did it succeed? */
+	if (server->state == SS_CONNECTING)
+	{
+		if (events & EV_FLUSH) return;
+
+		if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) != 0) err = errno;
+		if (err != 0)
+		{
+			log_warn(server, "Couldn't connect to %s:%s (address %u of %u): %s (%d)\n",
+				server->hostname, server->port, server->nextaddr, server->numaddrs, strerror(err), err);
+			server_connect_failed(server);
+			return;
+		}
+
+		log_debug(server, "%s:%s is now connected\n", server->hostname, server->port);
+		server_connect_done(server);
+		event_modify(sock, EV_READ);
+		server_login(server);
+		return;
+	}
+
+	if (events & EV_ERROR)
+	{
+		log_debug(server, "[%s@%s:%s] Socket error, disconnecting\n", server->name, server->hostname, server->port);
+		server_disconnect(server);
+		return;
+	}
+
+	if (events & (EV_WRITE|EV_FLUSH)) server_write(server);
+	if (events & EV_READ && server->socket != -1) server_handle(server);
+}
@@ -33,7 +33,7 @@ bool load_config()
 		!g_conf->config_password ||
 		g_conf->servers->count < 2)
 	{
-		dolog(LOG_ERR, "core", "Please configure me completely first, The Talamasca is not a mere toy..\n");
+		log_err(core, "Please configure me completely first, The Talamasca is not a mere toy..\n");
 		return false;
 	}
 	return true;
@@ -44,7 +44,7 @@ void init()
 	g_conf = malloc(sizeof(struct conf));
 	if (!g_conf)
 	{
-		dolog(LOG_ERR, "core", "Couldn't init()\n");
+		log_err(core, "Couldn't init()\n");
 		exit(-1);
 	}
 
@@ -53,19 +53,33 @@ void init()
 	
 	g_conf->boottime		= time(NULL);
 	g_conf->config_file		= strdup("/etc/talamasca.conf");
+	g_conf->resolve_ttl		= RESOLVE_TTL;
+	g_conf->burst_lines		= BURST_LINES;
+	g_conf->burst_usec		= BURST_USEC;
+	g_conf->log_categories		= LOGC_ALL;
 
-	/* Initialize select */
-	FD_ZERO(&g_conf->selectset);
+	/* Initialize the event loop */
+	if (!event_init())
+	{
+		log_err(core, "Couldn't initialize the event loop\n");
+		exit(-1);
+	}
+
+	/* Set up the command dispatch and casemapping tables */
+	server_commands_init();
+	casemap_init();
 
 	/* Initialize our list of servers */
 	g_conf->servers			= list_new();
 	g_conf->servers->del 		= (void(*)(void *))server_destroy;
 
 	/* Initialize our list of users */
-	g_conf->users			= list_new();
-	g_conf->users->del 		= NULL;
+	dlist_init(&g_conf->users);
 	/* Deleting the servers will remove the users ;) */
 
+	/* Index of the users by nick */
+	g_conf->nicks			= hash_new(user_cmp_nick);
+
 	/* Users have to !add themselves */
 	g_conf->bitlbee_auto_add	= false;
 }
@@ -84,12 +98,9 @@ int main(int argc, char *argv[], char *envp[])
 {
 	int			i, drop_uid = 0, drop_gid = 0, option_index = 0;
 	struct passwd		*passwd;
-	fd_set			fd_read, fd_except;
-	struct timeval		timeout;
 	struct listnode		*ln;
 	struct server		*server;
-	int			len;
-	bool			quit = false;
+	time_t			now, lastcheck = 0;
 
 	/* Initialize */
 	init();
@@ -177,10 +188,10 @@ int main(int argc, char *argv[], char *envp[])
 	signal(SIGUSR2, SIG_IGN);
 	signal(SIGPIPE, SIG_IGN);
 
-	/* Handle SIGTERM/INT/KILL to cleanup the pid file and exit */
-	signal(SIGTERM,	&cleanpid);
-	signal(SIGINT,	&cleanpid);
-	signal(SIGKILL,	&cleanpid);
+	/* Handle SIGTERM/INT/KILL to leave the main loop, which cleans up the pid file */
+	signal(SIGTERM,	&quitsignal);
+	signal(SIGINT,	&quitsignal);
+	signal(SIGKILL,	&quitsignal);
 
 	/*
 	 * Show our version in the startup logs ;)
@@ -188,7 +199,7 @@ int main(int argc, char *argv[], char *envp[])
 	 * then keep at least the Copyright notice in there.
 	 * Some people simply want a little respect and credit.
 	 */
-	dolog(LOG_INFO, "core", "Talamasca %s (C) Copyright Jeroen Massar 2004 All Rights Reserved\n", TALAMASCA_VERSION);
+	log_info(core, "Talamasca %s (C) Copyright Jeroen Massar 2004 All Rights Reserved\n", TALAMASCA_VERSION);
 
 	/* Save our PID */
 	savepid();
@@ -200,63 +211,84 @@ int main(int argc, char *argv[], char *envp[])
 	if (drop_uid != 0) setuid(drop_uid);
 	if (drop_gid != 0) setgid(drop_gid);
 
+	/* Hand the logging to the logger thread */
+	if (!log_init())
+	{
+		log_err(core, "Couldn't initialize the logger\n");
+		return -1;
+	}
+
+	/*
+	 * Start the resolver, this uses threads
+	 * thus only do this after daemonizing
+	 */
+	if (!resolve_init())
+	{
+		log_err(core, "Couldn't initialize the resolver\n");
+		return -1;
+	}
+
 	/* Load config */
 	if (!load_config()) return -1;
 
-	dolog(LOG_DEBUG, "core", "Going into mainloop...\n");
+	log_debug(core, "Going into mainloop...\n");
 
 	/* For almost ever */
-	while (!g_conf->quit && !quit)
+	while (!g_conf->quit)
 	{
-		if (g_conf->numsocks > 0)
+		/* Wait for sockets, only the ones that are ready get handled, don't sleep while bursting */
+		if (event_loop(server_burst_pending() ? 0 : 5000) < 0)
 		{
-			/* What we want to know */
-			memcpy(&fd_read, &g_conf->selectset, sizeof(fd_read));
-			memcpy(&fd_except, &g_conf->selectset, sizeof(fd_except));
+			log_err(core, "Event loop failed\n");
+			break;
+		}
 
-			/* Timeout */
-			memset(&timeout, 0, sizeof(timeout));
-			timeout.tv_sec = 5;
+		/* Continue introducing to new links */
+		server_burst_continue();
 
-			i = select(g_conf->hifd+1, &fd_read, NULL, &fd_except, &timeout);
-			if (i < 0)
-			{
-				quit = true;
-				if (errno == EINTR) continue;
-				dolog(LOG_ERR, "core", "Select failed\n");
-				break;
-			}
-		}
-		else
-		{
-			/* No sockets at all? -> Sleep 5 seconds */
-			dolog(LOG_DEBUG, "core", "Sleeping for 5 seconds because we have no sockets at all\n");
-			sleep(5);
-		}
+		/* Check for servers that need a (re)connect or disconnect, once a second is plenty */
+		now = time(NULL);
+		if (now == lastcheck) continue;
+		lastcheck = now;
+
+		/* Control sessions which don't authenticate or idle */
+		cfg_timeout(now);
 
 		LIST_LOOP(g_conf->servers, server, ln)
 		{
-			if (server->socket == -1)
-			{
-				server_connect(server);
-			}
-			else if (FD_ISSET(server->socket, &fd_except))
-			{
-				server_disconnect(server);
-			}
-			else if (FD_ISSET(server->socket, &fd_read))
+			/* Drop links which could not keep up with their output */
+			if (server->sendq_exceeded) server_disconnect(server);
+
+			/* Give up on connects which don't finish, the next address gets a try */
+			if (	server->state == SS_CONNECTING &&
+				now > server->lastconnect + CONNECT_TIMEOUT)
 			{
-				server_handle(server);
+				log_warn(core, "Connect to %s:%s timed out\n", server->hostname, server->port);
+				server_connect_failed(server);
 			}
+
+			if (server->socket == -1) server_connect(server);
 		}
 	}
 
 	/* Show the message in the log */
-	dolog(LOG_INFO, "core", "Shutdown, thank you for using The Talamasca, remember: we watch and we are always here\n");
+	if (g_conf->quit) log_info(core, "Trying to exit...\n");
+	log_info(core, "Shutdown, thank you for using The Talamasca, remember: we watch and we are always here\n");
 
 	/* Cleanup the lists */
-	list_delete(g_conf->users);
 	list_delete(g_conf->servers);
+	hash_free(g_conf->nicks);
+
+	/* Close the control sockets, the resolver and the event loop */
+	cfg_exit();
+	resolve_exit();
+	event_exit();
+
+	/* Nothing uses the pools anymore */
+	pool_exit();
+
+	/* Write out the last log lines */
+	log_exit();
 	
 	/* TODO: free various strings in g_conf */
 
@@ -265,7 +297,7 @@ int main(int argc, char *argv[], char *envp[])
 	g_conf = NULL;
 
 	/* We are out of here */
-	cleanpid(SIGINT);
+	cleanpid();
 
 	return 0;
 }
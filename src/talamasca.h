@@ -15,6 +15,11 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/random.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -22,6 +27,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <string.h>
 #include <strings.h>
@@ -35,6 +41,14 @@
 
 #define PIDFILE "/var/run/talamasca.pid"
 #define BUFFERSIZE 2048
+#define SENDQ_MAX (512*1024)
+#define CFG_SENDQ_MAX (64*1024)			/* Output a control session may have waiting */
+#define CONNECT_TIMEOUT 30
+#define RESOLVE_TTL 300
+#define IRC_MAXLINE 512				/* Longest IRC line, including the \r\n */
+#define MAXTARGETS_MAX 32			/* Targets per message when a server sets no limit */
+#define BURST_LINES 200				/* Burst steps per time slice */
+#define BURST_USEC 10000			/* Length of a burst time slice */
 
 #ifdef DEBUG
 #define D(x) x
@@ -42,7 +56,37 @@
 #define D(x) {}
 #endif
 
+/* Least important log level that gets compiled in, override with -DLOG_MAXLEVEL=<level> */
+#ifndef LOG_MAXLEVEL
+#ifdef DEBUG
+#define LOG_MAXLEVEL LOG_DEBUG
+#else
+#define LOG_MAXLEVEL LOG_INFO
+#endif
+#endif
+
+/* Log categories, the debug output can be limited to some of them (set log_categories) */
+enum logcategory
+{
+	LOGC_core,
+	LOGC_common,
+	LOGC_event,
+	LOGC_resolve,
+	LOGC_intern,
+	LOGC_log,
+	LOGC_parse,
+	LOGC_server,
+	LOGC_privmsg,
+	LOGC_channel,
+	LOGC_user,
+	LOGC_config,
+	LOGC_MAX
+};
+#define LOGC_ALL ((1 << LOGC_MAX) - 1)
+
 #include "linklist.h"
+#include "hash.h"
+#include "pool.h"
 
 /* Booleans */
 #define false	0
@@ -59,6 +103,8 @@
 enum states
 {
 	SS_DISCONNECTED = 0,
+	SS_RESOLVING,
+	SS_CONNECTING,
 	SS_AUTHENTICATING,
 	SS_CONNECTED
 };
@@ -72,13 +118,51 @@ enum srv_types
 	SRV_P10			/* P10 server<->server protocol (http://www.xs4all.nl/~carlo17/irc/P10.html) */
 };
 
+/* How nicks and channelnames are folded (CASEMAPPING in 005) */
+enum casemapping
+{
+	CASEMAP_ASCII,		/* Only A-Z */
+	CASEMAP_RFC1459,	/* A-Z and []\^ are the uppercase of {}|~ (default) */
+	CASEMAP_STRICT_RFC1459,	/* Like rfc1459 but without ^ and ~ */
+	CASEMAP_MAX
+};
+
+/*
+ * The global nick index folds with the widest casemapping, nicks equal
+ * on any link are equal under it. Lookups then apply the rules of
+ * the link the nick came from, see user_find_nick()
+ */
+#define CASEMAP_NICKS CASEMAP_RFC1459
+
+/* Events we can wait for on a socket */
+#define EV_READ		0x01
+#define EV_WRITE	0x02
+#define EV_ERROR	0x04
+#define EV_FLUSH	0x08				/* Deferred output, see event_defer() */
+
+/* A socket registered with the event loop */
+struct event
+{
+	unsigned int		events;				/* EV_* we are waiting for */
+	void			(*handler)(SOCKET sock, unsigned int events, void *data);
+	void			*data;				/* Passed to the handler */
+	bool			deferred;			/* Waiting for an EV_FLUSH */
+};
+
 /* Our configuration structure */
 struct conf
 {
-	fd_set			selectset;			/* Select set */
-	int			hifd;				/* Highest FD in use */
-	unsigned int		numsocks;			/* Number of sockets still open */
+	SOCKET			epoll;				/* epoll descriptor */
+	struct event		*events;			/* Handlers, indexed by socket */
+	unsigned int		numevents;			/* Size of the events table */
+	SOCKET			*deferred;			/* Sockets waiting for an EV_FLUSH */
+	unsigned int		numdeferred;			/* Number of deferred sockets */
+	unsigned int		sizedeferred;			/* Size of the deferred table */
 	time_t			boottime;			/* Bootup time */
+	unsigned int		resolve_ttl;			/* Seconds to cache resolved hostnames */
+	unsigned int		burst_lines;			/* Burst steps per time slice */
+	unsigned int		burst_usec;			/* Microseconds per burst time slice */
+	unsigned int		bursting;			/* Number of links being bursted */
 	char			*config_file;			/* Configuration file */
 	
 	char			*service_name;			/* Global name of this service */
@@ -90,11 +174,13 @@ struct conf
 	unsigned char		*config_password;		/* Configuration password */
 
 	struct list		*servers;			/* Servers */
-	struct list		*users;				/* Users */
+	struct dlist		users;				/* Users (struct user) */
+	struct hash		*nicks;				/* Users, indexed by nick */
 
 	bool			daemonize;			/* To Daemonize or to not to Daemonize */
 	bool			verbose;			/* Verbose Operation ? */
-	bool			quit;				/* Global Quit signal */
+	unsigned int		log_categories;			/* Categories with debug output (1 << LOGC_*) */
+	volatile bool		quit;				/* Global Quit signal, set from a signal handler */
 
 	bool			bitlbee_auto_add;		/* true = !add automatic, false = user must do !add */
 };
@@ -102,21 +188,145 @@ struct conf
 /* Global Stuff */
 extern struct conf *g_conf;
 
+/* A message that is queued on several sockets, immutable once created */
+struct msgbuf
+{
+	unsigned int		refs;				/* Number of holders */
+	unsigned int		len;				/* Length of data */
+	char			data[1];			/* The message itself */
+};
+
+/* Take another reference on a message */
+static inline struct msgbuf *msgbuf_ref(struct msgbuf *m)
+{
+	m->refs++;
+	return m;
+}
+
+/* A piece of queued output, either a shared message or data copied into the queue */
+struct sendseg
+{
+	struct msgbuf		*msg;				/* Shared message, NULL when in sendq->buf */
+	unsigned int		off;				/* Start of the unsent data */
+	unsigned int		len;				/* Number of unsent bytes */
+};
+
+/* Output queue of a non-blocking socket */
+struct sendq
+{
+	char			*buf;				/* Copied data */
+	unsigned int		size;				/* Allocated size of buf */
+	unsigned int		used;				/* End of the copied data */
+	struct sendseg		*segs;				/* Queued pieces, in order */
+	unsigned int		head;				/* First unsent piece */
+	unsigned int		numsegs;			/* End of the pieces */
+	unsigned int		sizesegs;			/* Allocated number of pieces */
+	unsigned int		depth;				/* Number of unsent bytes */
+};
+
+/* Maximum number of pieces handed to one writev() */
+#define SENDQ_IOV 64
+
+#define sendq_depth(q)	((q)->depth)
+
+/* Input buffer of a line based socket */
+struct linebuf
+{
+	char			buf[BUFFERSIZE];		/* Received data */
+	unsigned int		start;				/* Start of the unprocessed data */
+	unsigned int		filled;				/* How far the buffer is filled */
+	unsigned int		scanned;			/* Searched for newlines up to here */
+};
+
+/* Walks the fields of a string, the current field is a span into it */
+struct fielditer
+{
+	const char		*next;				/* Where the next field starts */
+	const char		*field;				/* Start of the current field (not terminated) */
+	unsigned int		len;				/* Length of the current field */
+};
+
+/* log */
+
+/*
+ * Use log_err(), log_warn(), log_info() and log_debug() with the category
+ * as the first argument, eg log_debug(server, "..."). Levels above
+ * LOG_MAXLEVEL are compiled out, debug lines are only formatted when
+ * running verbose and their category is enabled.
+ */
+#define log_enabled(level, cat) \
+	((level) <= LOG_MAXLEVEL && \
+	 ((level) != LOG_DEBUG || !g_conf || (g_conf->verbose && (g_conf->log_categories & (1 << (cat))))))
+#define log_at(level, cat, ...) \
+	do { if (log_enabled(level, LOGC_##cat)) log_printf(level, #cat, __VA_ARGS__); } while (0)
+#define log_err(cat, ...)	log_at(LOG_ERR, cat, __VA_ARGS__)
+#define log_warn(cat, ...)	log_at(LOG_WARNING, cat, __VA_ARGS__)
+#define log_info(cat, ...)	log_at(LOG_INFO, cat, __VA_ARGS__)
+#define log_debug(cat, ...)	log_at(LOG_DEBUG, cat, __VA_ARGS__)
+
+void log_printf(int level, char *module, const char *fmt, ...);
+void dologA(int level, char *module, const char *fmt, va_list ap);
+uint64_t log_dropped(int level);
+bool log_set_categories(const char *list);
+bool log_init();
+void log_exit();
+
 /* common */
-void dolog(int level, char *module, const char *fmt, ...);
 int huprunning();
 void savepid();
-void cleanpid(int i);
+void quitsignal(int i);
+void cleanpid();
 int sock_printfA(SOCKET sock, const char *fmt, va_list ap);
 int sock_printf(SOCKET sock, const char *fmt, ...);
-int sock_getline(SOCKET sock, char *rbuf, unsigned int rbuflen, unsigned int *filled, char *ubuf, unsigned int ubuflen);
-SOCKET connect_client(const char *hostname, const char *port, int family, int socktype);
-unsigned int countfields(char *s);
-bool copyfields(char *s, unsigned int n, unsigned int count, char *buf, unsigned int buflen);
-#define copyfield(s,n,buf,buflen) copyfields(s,n,1,buf,buflen)
+struct msgbuf *msgbuf_new(const char *data, unsigned int len);
+struct msgbuf *msgbuf_line(const char *fmt, ...);
+struct msgbuf *msgbuf_lineA(const char *fmt, va_list ap);
+void msgbuf_release(struct msgbuf *m);
+bool sendq_append(struct sendq *q, const char *data, unsigned int len);
+bool sendq_append_msg(struct sendq *q, struct msgbuf *m);
+int sendq_flush(SOCKET sock, struct sendq *q);
+void sendq_free(struct sendq *q);
+void linebuf_reset(struct linebuf *lb);
+int sock_getline(SOCKET sock, struct linebuf *lb, char **line, unsigned int *linelen);
+SOCKET connect_client(int family, const struct sockaddr *addr, socklen_t addrlen);
+SOCKET listen_server(int family, const struct sockaddr *addr, socklen_t addrlen);
+void field_init(struct fielditer *it, const char *s);
+bool field_next(struct fielditer *it);
+void field_copy(const struct fielditer *it, char *buf, unsigned int buflen);
+bool field_copynext(struct fielditer *it, char *buf, unsigned int buflen);
 
 /* config */
 bool cfg_fromfile_direct(char *file);
+void cfg_timeout(time_t now);
+void cfg_exit();
+
+/* event */
+bool event_init();
+void event_exit();
+bool event_add(SOCKET sock, unsigned int events, void (*handler)(SOCKET sock, unsigned int events, void *data), void *data);
+bool event_modify(SOCKET sock, unsigned int events);
+void event_del(SOCKET sock);
+void event_defer(SOCKET sock);
+int event_loop(int timeout);
+
+/* resolve */
+bool resolve_init();
+void resolve_exit();
+void resolve(const char *hostname, const char *service, int family, int socktype, void (*callback)(struct addrinfo *res, void *data), void *data);
+void resolve_cancel(void *data);
+
+/* casemap */
+void casemap_init();
+enum casemapping casemap_find(const char *name);
+const char *casemap_name(enum casemapping cm);
+unsigned int casemap_fold(enum casemapping cm, const char *s, char *buf, unsigned int buflen);
+char *casemap_key(enum casemapping cm, const char *s);
+unsigned int casemap_hash(const char *key);
+
+/* intern */
+char *str_intern(const char *str);
+void str_release(char *str);
+unsigned int str_interned();
 
 /* MD5 */
 #define md5byte unsigned char
@@ -135,6 +345,33 @@ void MD5Final(unsigned char digest[16], struct MD5Context *context);
 void MD5Transform(UWORD32 buf[4], UWORD32 const in[16]);
 
 
+/* An address of a server, copied from the result of the resolver */
+struct connaddr
+{
+	struct sockaddr_storage	addr;
+	socklen_t		addrlen;
+};
+
+/* Progress of introducing our users and channels to a freshly connected link */
+struct burst
+{
+	bool			active;		/* Still busy */
+	struct dlistnode	*user;		/* Next user (g_conf->users) */
+	struct listnode		*channel;	/* Channel being filled, NULL while introducing users */
+	unsigned int		done;		/* Steps done */
+	unsigned int		slices;		/* Time slices used */
+	struct timeval		start;		/* When it started */
+};
+
+/* Nicks waiting to be joined to a channel on a server link in one SJOIN */
+struct sjoin
+{
+	struct channel		*channel;	/* The channel, NULL when nothing is waiting */
+	unsigned int		nicks;		/* Number of nicks in the line */
+	unsigned int		len;		/* Length of the line */
+	char			line[IRC_MAXLINE];
+};
+
 /* A server */
 struct server
 {
@@ -147,6 +384,9 @@ struct server
 	char		*password;		/* Password */
 	char		*identity;		/* The identity this server has */
 	char		*description;		/* Description */
+	enum casemapping casemapping;		/* How nicks and channelnames are folded on this link */
+	unsigned int	maxtargets;		/* Targets per PRIVMSG, from TARGMAX/MAXTARGETS in 005 */
+	unsigned int	maxtargets_conf;	/* Configured number of targets, 0 = what the server says */
 
 	struct user	*user;			/* Server user (when in user mode) */
 	struct channel	*defaultchannel;	/* The channel to map our users onto */
@@ -154,12 +394,21 @@ struct server
 	time_t		lastconnect;		/* Last time we tried to connect */
 	SOCKET		socket;			/* The socket */
 	enum states	state;			/* Server State */
+	struct connaddr	*addrs;			/* Addresses of this connect, see server_connect_next() */
+	unsigned int	numaddrs;		/* Number of addrs */
+	unsigned int	nextaddr;		/* Next of addrs to try */
+	struct burst	burst;			/* Burst after connecting, see server_burst() */
+	struct sjoin	sjoin;			/* SJOIN being packed, see channel_sjoin() */
+
+	struct linebuf	rbuf;			/* Read buffer */
 
-	char		buffer[BUFFERSIZE];	/* Read buffer */
-	unsigned int	bufferfill;		/* How far the buffer is filled */
+	struct sendq	sendq;			/* Output waiting for the socket to become writable */
+	bool		sendq_exceeded;		/* Output was dropped, disconnect this link */
 
-	struct list	*users;			/* Users (struct serveruser) */
+	struct dlist	users;			/* Users (struct serveruser) */
+	struct ptrhash	members;		/* Users, indexed by struct user * (struct serveruser) */
 	struct list	*channels;		/* Channels (struct channel) */
+	struct hash	*channelnames;		/* Channels, indexed by name */
 
 	/* Bitlbee support */
 	char		*bitlbee_identifypass;	/* The password to identify our account on the BitlBee server */
@@ -171,6 +420,8 @@ struct server
 			stat_recv_bytes;	/* Number of bytes received */
 };
 
+#define server_maxtargets(s)	((s)->maxtargets_conf ? (s)->maxtargets_conf : (s)->maxtargets)
+
 /* A user on a server */
 struct serveruser
 {
@@ -178,6 +429,7 @@ struct serveruser
 	struct server	*server;	/* The server */
 	struct user	*user;		/* The user */
 	bool		introduced;	/* Did we introduce this user already? */
+	struct dlistnode node;		/* On server->users */
 };
 
 /* user */
@@ -186,15 +438,17 @@ struct user
 	bool		config;		/* Configuration item? */
 
 	char		*nick;		/* The nick of the user on this server */
+	char		*foldnick;	/* Nick folded with CASEMAP_NICKS, key in g_conf->nicks */
 	char		*ident;		/* Ident of the user */
 	char		*host;		/* Host of the user */
 	char		*realname;	/* Realname of the user */
 	char		*away;		/* Away message */
 
 	struct server	*server;	/* On which server this user lives */
-	struct list	*channels;	/* Channels this user is on (struct channel) */
+	struct dlist	channels;	/* Channels this user is on (struct channeluser) */
 	
 	time_t		lastmessage;	/* Last message */
+	struct dlistnode node;		/* On g_conf->users */
 };
 
 /* channel */
@@ -204,9 +458,11 @@ struct channel
 
 	char		*tag;		/* Channel Tag */
 	char		*name;		/* Channel name */
+	char		*foldname;	/* Casemapped name, key in server->channelnames */
 
 	struct server	*server;	/* The server this channel lives on */
-	struct list	*users;		/* Users on this channel (channeluser) */
+	struct dlist	users;		/* Users on this channel (struct channeluser) */
+	struct ptrhash	members;	/* Users on this channel, indexed by struct user * (channeluser) */
 
 	char		*topic;		/* The topic of the channel */
 	char		*topic_who;	/* Who set the topic */
@@ -239,26 +495,42 @@ struct channeluser
 	bool		f_creator;	/* User created the channel */
 	bool		f_operator;	/* User has ops */
 	bool		f_voice;	/* User has voice */
+
+	struct dlistnode channelnode;	/* On channel->users */
+	struct dlistnode usernode;	/* On user->channels */
 };
 
 /* Server */
 void server_printf(struct server *server, const char *fmt, ...);
+void server_sendv(struct server *server, const struct iovec *iov, unsigned int iovcnt, struct msgbuf *body);
 struct server *server_find_tag(char *tag);
 struct server *server_add(char *tag, enum srv_types type, char *hostname, char *port, char *nickname, char *name, char *password, char *identity, char *description);
 void server_destroy(struct server *server);
 void server_disconnect(struct server *server);
 void server_connect(struct server *server);
+void server_resolved(struct addrinfo *res, void *data);
+void server_connect_failed(struct server *server);
 void server_handle(struct server *server);
+void server_commands_init();
+void server_commands_stats(struct server *server, const char *source);
+void server_event(SOCKET sock, unsigned int events, void *data);
+void server_write(struct server *server);
 void server_user_change_nick(struct server *server, struct user *user, char *oldnick);
 struct serveruser *server_introduce(struct server *server, struct user *user);
 void server_leave(struct server *server, struct user *user, char *reason, bool kill);
+bool server_burst_pending();
+void server_burst_continue();
+void server_burst_forget_user(struct user *user);
+void server_burst_forget_channel(struct channel *channel);
 
 /* User */
+int user_cmp_nick(const void *data, const void *nick);
 struct user *user_add(char *nick, struct server *server, bool config);
 void user_destroy(struct user *user, char *reason);
+void user_free(struct user *user);
 void user_introduce(struct user *user);
 void user_resetidle(struct user *user);
-struct user *user_find_nick(char *nick);
+struct user *user_find_nick(struct server *server, char *nick);
 void user_change_away(struct user *user, char *reason);
 void user_change_nick(struct user *user, char *newnick, bool local);
 void user_change_ident(struct user *user, char *ident);
@@ -266,12 +538,17 @@ void user_change_host(struct user *user, char *host);
 void user_change_realname(struct user *user, char *realname);
 
 /* Channel */
+int channel_cmp_name(const void *data, const void *name);
 struct channel *channel_find_tag(char *tag);
 struct channel *channel_add(struct server *server, char *name, char *tag);
 void channel_destroy(struct channel *channel);
 void channel_link(struct channel *channel, struct channel *link);
 struct channeluser *channel_find_user(struct channel *channel, struct user *user);
+void channeluser_destroy(struct channeluser *cu);
+void channel_relay(struct channel *channel, struct user *user, struct msgbuf *body);
 void channel_message(struct channel *channel, struct user *user, char *message, ...);
+void channel_introduce(struct channel *channel, struct user *user);
+void channel_sjoin_flush(struct server *server);
 void channel_adduser(struct channel *channel, struct user *user);
 void channel_deluser(struct channel *channel, struct user *user, char *reason, bool notify);
 void channel_change_topic(struct channel *channel, char *who);
@@ -13,37 +13,66 @@
 
 #include "talamasca.h"
 
+/* Where the users come from */
+static struct pool user_pool = POOL_INIT("user", struct user);
+
+/* What user_find_nick() looks for */
+struct nickmatch
+{
+	const char		*foldnick;	/* Folded with CASEMAP_NICKS */
+	enum casemapping	cm;		/* Casemapping of the link asking */
+	const char		*linknick;	/* Folded with cm */
+};
+
+/*
+ * Match function for the nick index, matches on the canonically folded
+ * nick, and when the link asking folds less also on its own folding
+ */
+int user_cmp_nick(const void *data, const void *match)
+{
+	const struct user	*u = (const struct user *)data;
+	const struct nickmatch	*m = (const struct nickmatch *)match;
+	char			foldnick[1024];
+
+	if (strcmp(u->foldnick, m->foldnick) != 0) return 1;
+	if (m->cm == CASEMAP_NICKS) return 0;
+
+	casemap_fold(m->cm, u->nick, foldnick, sizeof(foldnick));
+	return strcmp(foldnick, m->linknick);
+}
+
 struct user *user_add(char *nick, struct server *server, bool config)
 {
-	struct user *user = malloc(sizeof(*user));
+	struct user *user;
 	
 	if (!server)
 	{
-		dolog(LOG_ERR, "user", "Even %s can't live without a server!\n", nick);
+		log_err(user, "Even %s can't live without a server!\n", nick);
 		return NULL;
 	}
+	user = pool_alloc(&user_pool);
 	if (!user)
 	{
-		dolog(LOG_ERR, "user", "Not enough memory left to create a new user!?\n");
+		log_err(user, "Not enough memory left to create a new user!?\n");
 		exit(-1);
 	}
 
-	if (server) dolog(LOG_DEBUG, "user", "user_add(%s,%s:%s)\n", nick, server->hostname, server->port);
-	else dolog(LOG_DEBUG, "user", "user_add(%s)\n", nick);
+	if (server) log_debug(user, "user_add(%s,%s:%s)\n", nick, server->hostname, server->port);
+	else log_debug(user, "user_add(%s)\n", nick);
 
 	/* Initialize */
-	memset(user, 0, sizeof(*user));
-	user->nick		= strdup(nick);
+	user->nick		= str_intern(nick);
+	user->foldnick		= casemap_key(CASEMAP_NICKS, nick);
 	user->server		= server;
-	user->channels		= list_new();
-	user->channels->del 	= NULL;
+	dlist_init(&user->channels);
 	user->config		= config;
 
 	/* Login time is last message time */
 	user->lastmessage	= time(NULL);
 
 	/* Add the user */
-	listnode_add(g_conf->users, user);
+	dlist_add(&g_conf->users, &user->node, user);
+	hash_add(g_conf->nicks, casemap_hash(user->foldnick), user);
 	return user;
 }
 
@@ -56,36 +85,37 @@ void user_change_ident(struct user *user, char *ident)
 {
 	if (!user)
 	{
-		dolog(LOG_DEBUG, "user", "user_change_ident() - Something passed me a NULL user!\n");
+		log_debug(user, "user_change_ident() - Something passed me a NULL user!\n");
 		return;
 	}
-	if (user->ident)	free(user->ident);
-	if (ident)		user->ident = strdup(ident);
-	else			user->ident = NULL;
+	/* Interned, thus the old one can go after taking the new one */
+	ident = str_intern(ident);
+	str_release(user->ident);
+	user->ident = ident;
 }
 
 void user_change_host(struct user *user, char *host)
 {
 	if (!user)
 	{
-		dolog(LOG_DEBUG, "user", "user_change_host() - Something passed me a NULL user!\n");
+		log_debug(user, "user_change_host() - Something passed me a NULL user!\n");
 		return;
 	}
-	if (user->host)		free(user->host);
-	if (host)		user->host = strdup(host);
-	else			user->host = NULL;
+	host = str_intern(host);
+	str_release(user->host);
+	user->host = host;
 }
 
 void user_change_realname(struct user *user, char *realname)
 {
 	if (!user)
 	{
-		dolog(LOG_DEBUG, "user", "user_change_realname() - Something passed me a NULL user!\n");
+		log_debug(user, "user_change_realname() - Something passed me a NULL user!\n");
 		return;
 	}
-	if (user->realname)	free(user->realname);
-	if (realname)		user->realname = strdup(realname);
-	else			user->realname = NULL;
+	realname = str_intern(realname);
+	str_release(user->realname);
+	user->realname = realname;
 }
 
 void user_introduce(struct user *user)
@@ -95,7 +125,7 @@ void user_introduce(struct user *user)
 	
 	if (!user->ident || !user->host || !user->realname)
 	{
-		dolog(LOG_ERR, "user", "Not introducing user %s!%s@%s (%s), some are empty",
+		log_err(user, "Not introducing user %s!%s@%s (%s), some are empty",
 			user->nick, user->ident, user->host, user->realname);
 		return;
 	}
@@ -109,29 +139,26 @@ void user_introduce(struct user *user)
 
 void user_leave(struct user *user, char *reason)
 {
-	struct server	*srv;
-	struct channel	*ch;
-	struct listnode	*ln;
-	unsigned int	i;
-
-	dolog(LOG_DEBUG, "user", "Taking user %s!%s@%s from the channels\n", user->nick, user->ident, user->host);
-
-	/* Remove the user from all channels she is on */
-	while (user->channels->count > 0)
+	struct server		*srv;
+	struct channeluser	*cu;
+	struct listnode		*ln;
+
+	log_debug(user, "Taking user %s!%s@%s from the channels\n", user->nick, user->ident, user->host);
+
+	/*
+	 * Remove the user from all channels she is on,
+	 * this also removes her from the linked channel,
+	 * which can be the next one, thus restart every time
+	 */
+	while ((cu = user->channels.head ? user->channels.head->data : NULL) != NULL)
 	{
-		LIST_LOOP(user->channels, ch, ln)
-		{
-			dolog(LOG_DEBUG, "user", "Removing %s!%s@%s from %s (%u channels left)\n",
-				user->nick, user->ident, user->host, ch->name, user->channels->count);
-			/* Remove the user from the channel */
-			channel_deluser(ch, user, "Quiting...", true);
-			/* Start checking at the beginning as the list changed */
-			break;
-		}
-		if (!ln) break;
+		log_debug(user, "Removing %s!%s@%s from %s (%u channels left)\n",
+			user->nick, user->ident, user->host, cu->channel->name, user->channels.count);
+		/* Remove the user from the channel */
+		channel_deluser(cu->channel, user, "Quiting...", true);
 	}
 
-	dolog(LOG_DEBUG, "user", "Taking user %s!%s@%s from global user list\n", user->nick, user->ident, user->host);
+	log_debug(user, "Taking user %s!%s@%s from global user list\n", user->nick, user->ident, user->host);
 
 	/* Quit the user from the servers we have */
 	LIST_LOOP(g_conf->servers, srv, ln)
@@ -142,55 +169,67 @@ void user_leave(struct user *user, char *reason)
 
 void user_destroy(struct user *user, char *reason)
 {
-	struct channel	*channel;
-	struct listnode	*cn, *cn2;
-
 	if (!user) return;
 
-	dolog(LOG_DEBUG, "user", "Destroying user %s!%s@%s\n", user->nick, user->ident, user->host);
+	log_debug(user, "Destroying user %s!%s@%s\n", user->nick, user->ident, user->host);
 
 	/* Let the user leave all the servers */
 	user_leave(user, reason);
 
+	user_free(user);
+}
+
+/* Forget about a user who is not on any server or channel anymore */
+void user_free(struct user *user)
+{
 	/* Remove the user from the global user list */
-	listnode_delete(g_conf->users, user);
+	server_burst_forget_user(user);
+	dlist_unlink(&g_conf->users, &user->node);
+	hash_delete(g_conf->nicks, casemap_hash(user->foldnick), user);
 
 	/* The last log message about this user */
-	dolog(LOG_DEBUG, "user", "User %s!%s@%s is goners\n", user->nick, user->ident, user->host);
+	log_debug(user, "User %s!%s@%s is goners\n", user->nick, user->ident, user->host);
 
 	/* Free the node */
-	if (user->nick)		free(user->nick);
-	if (user->ident)	free(user->ident);
-	if (user->host)		free(user->host);
-	if (user->realname)	free(user->realname);
+	str_release(user->nick);
+	str_release(user->foldnick);
+	str_release(user->ident);
+	str_release(user->host);
+	str_release(user->realname);
 	if (user->away)		free(user->away);
 
 	/* Free the memory */
-	free(user);
+	pool_free(&user_pool, user);
 }
 
-struct user *user_find_nick(char *nick)
+/* Find a user by nick, compared using the casemapping of <server> where the nick came from */
+struct user *user_find_nick(struct server *server, char *nick)
 {
-	struct user	*u;
-	struct listnode	*un;
+	struct nickmatch	m;
+	char			foldnick[1024], linknick[1024];
 
 	if (!nick)
 	{
-		dolog(LOG_ERR, "user", "user_find_nick() - Something passed me a NULL nick!\n");
+		log_err(user, "user_find_nick() - Something passed me a NULL nick!\n");
 		return NULL;
 	}
-	LIST_LOOP(g_conf->users, u, un)
+	casemap_fold(CASEMAP_NICKS, nick, foldnick, sizeof(foldnick));
+	m.foldnick = foldnick;
+	m.cm = server->casemapping;
+	m.linknick = foldnick;
+	if (m.cm != CASEMAP_NICKS)
 	{
-		if (strcasecmp(u->nick, nick) == 0) return u;
+		casemap_fold(m.cm, nick, linknick, sizeof(linknick));
+		m.linknick = linknick;
 	}
-	return NULL;
+	return hash_find(g_conf->nicks, casemap_hash(foldnick), &m);
 }
 
 void user_change_away(struct user *user, char *reason)
 {
 	if (!user)
 	{
-		dolog(LOG_ERR, "user", "user_change_away() - Something passed me a NULL user!\n");
+		log_err(user, "user_change_away() - Something passed me a NULL user!\n");
 		return;
 	}
 
@@ -203,8 +242,8 @@ void user_change_away(struct user *user, char *reason)
 	if (reason)	user->away = strdup(reason);
 	else		user->away = NULL;
 
-	if (user->away) dolog(LOG_DEBUG, "user", "User %s's away: %s\n", user->nick, user->away);
-	else dolog(LOG_DEBUG, "user", "User %s is back\n", user->nick);
+	if (user->away) log_debug(user, "User %s's away: %s\n", user->nick, user->away);
+	else log_debug(user, "User %s is back\n", user->nick);
 }
 
 void user_change_nick(struct user *user, char *newnick, bool local)
@@ -215,18 +254,22 @@ void user_change_nick(struct user *user, char *newnick, bool local)
 
 	if (!user)
 	{
-		dolog(LOG_ERR, "user", "user_changenick(%s) - Something passed me a NULL user!\n", newnick);
+		log_err(user, "user_changenick(%s) - Something passed me a NULL user!\n", newnick);
 		return;
 	}
 
-	dolog(LOG_DEBUG, "user", "Changing %s!%s@%s's nick to %s\n",
+	log_debug(user, "Changing %s!%s@%s's nick to %s\n",
 		user->nick, user->ident, user->host, newnick);
 
 	/* Keep the oldnick for a moment */
 	oldnick = user->nick;
 
-	/* Change change it */
-	user->nick = strdup(newnick);
+	/* Change change it, also in the index */
+	hash_delete(g_conf->nicks, casemap_hash(user->foldnick), user);
+	str_release(user->foldnick);
+	user->nick = str_intern(newnick);
+	user->foldnick = casemap_key(CASEMAP_NICKS, newnick);
+	hash_add(g_conf->nicks, casemap_hash(user->foldnick), user);
 
 	LIST_LOOP(g_conf->servers, srv, sn)
 	{
@@ -237,5 +280,5 @@ void user_change_nick(struct user *user, char *newnick, bool local)
 	}
 
 	/* Throw away the old nickname */
-	free(oldnick);
+	str_release(oldnick);
 }